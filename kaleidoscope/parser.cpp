@@ -1,409 +1,7853 @@
+// build with
+//      clang++ -O2 parser.cpp `llvm-config --cxxflags` -std=c++17
+//          `llvm-config --ldflags --system-libs --libs core orcjit native passes
+//              linker bitreader bitwriter lto object profiledata`
+//          -pthread -o parser
+
 #include <utility>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <array>
+#include <charconv>
+#include <unordered_map>
 #include <memory>
+#include <new>
+#include <type_traits>
 #include <iostream>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <deque>
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <ctime>
+// std::__throw_bad_alloc, for operator new without exceptions
+#include <bits/functexcept.h>
 
+#include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/ProfileSummary.h"
+#include "llvm/IR/Type.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/LTO/LTO.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Object/ArchiveWriter.h"
+#include "llvm/Passes/OptimizationLevel.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/ProfileData/InstrProf.h"
+#include "llvm/ProfileData/ProfileCommon.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/IPO/ThinLTOBitcodeWriter.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/Reassociate.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
 
-///////////
-/* LEXER */
-///////////
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
-enum Token {
-    tok_eof = -1,
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 
-    tok_def = -2,
-    tok_extern = -3,
 
-    tok_ident = -4,
-    tok_num = -5,
+////////////
+/* OUTPUT */
+////////////
+
+// diagnostics, what the repl reports as it goes and its results all go
+// through a DiagnosticEngine, which formats straight into a fixed buffer
+// and writes it out when it fills or is flushed, so nothing is allocated
+// and there is no write per message. only a message longer than the
+// buffer, or in json longer than a few hundred chars, is formatted on the
+// heap.
+
+enum class Severity : uint8_t {
+    Note,
+    Warning,
+    Error,
 };
 
-static void print_curtok();
+static const char* const SeverityNames[] = {"note", "warning", "error"};
+static const char* const SeverityPrefixes[] = {"", "Warning: ", "Error: "};
+
+// --quiet drops the notes, e.g. that an item was parsed and its IR.
+// --diagnostics=json writes each diagnostic as a json object on a line of
+// its own, the rest of the output stays as it is.
+static bool QuietOutput = false;
+static bool JsonDiagnostics = false;
 
-static std::string IdentStr;
-static double NumVal;
+// where in which input a diagnostic is about
+struct SourceLocation {
+    const char* file;
+    uint32_t line;
+    uint32_t column;
+};
 
-static int gettok() {
-    static char last_char = ' ';
+class DiagnosticEngine {
+    FILE* out;
+    std::mutex mutex;
+    std::array<char, 16 << 10> buf;
+    size_t used = 0;
+    std::atomic<size_t> counts[3] = {};
 
-    while (isspace(last_char)) {
-        last_char = getchar();
+    void flush_locked() {
+        if (used > 0) {
+            fwrite(buf.data(), 1, used, out);
+            used = 0;
+        }
+        fflush(out);
     }
 
-    if (isalpha(last_char)) {
-        IdentStr = last_char;
-        while (isalnum(last_char = getchar())) {
-            IdentStr += last_char;
+    void write_locked(const char* p, size_t n) {
+        if (used + n > buf.size()) {
+            flush_locked();
+            if (n > buf.size()) {
+                fwrite(p, 1, n, out);
+                return;
+            }
         }
+        memcpy(buf.data() + used, p, n);
+        used += n;
+    }
+
+    template <size_t N>
+    void literal_locked(const char (&s)[N]) {
+        write_locked(s, N - 1);
+    }
 
-        if (IdentStr == "def") {
-            return tok_def;
+    void vformat_locked(const char* fmt, va_list args) {
+        va_list copy;
+        va_copy(copy, args);
+        size_t room = buf.size() - used;
+        int n = vsnprintf(buf.data() + used, room, fmt, copy);
+        va_end(copy);
+        if (n < 0) {
+            return;
+        }
+        if (size_t(n) < room) {
+            used += n;
+            return;
+        }
+        flush_locked();
+        if (size_t(n) < buf.size()) {
+            used = vsnprintf(buf.data(), buf.size(), fmt, args);
+            return;
         }
-        if (IdentStr == "extern") {
-            return tok_extern;
+        std::vector<char> big(n + 1);
+        vsnprintf(big.data(), big.size(), fmt, args);
+        fwrite(big.data(), 1, n, out);
+    }
+
+    void format_locked(const char* fmt, ...) {
+        va_list args;
+        va_start(args, fmt);
+        vformat_locked(fmt, args);
+        va_end(args);
+    }
+
+    void json_string_locked(const char* p, size_t n) {
+        literal_locked("\"");
+        for (size_t i = 0; i < n; i++) {
+            unsigned char c = p[i];
+            if (c == '"' || c == '\\') {
+                char esc[2] = {'\\', static_cast<char>(c)};
+                write_locked(esc, 2);
+            } else if (c < 0x20) {
+                format_locked("\\u%04x", c);
+            } else {
+                write_locked(p + i, 1);
+            }
         }
-        return tok_ident;
+        literal_locked("\"");
     }
 
-    if (isdigit(last_char) || last_char == '.') {
-        std::string numstr;
-        numstr += last_char;
+    void vreport(Severity sev, const SourceLocation* at, const char* fmt,
+                 va_list args) {
+        if (!wants(sev)) {
+            return;
+        }
+        ++counts[size_t(sev)];
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!JsonDiagnostics) {
+            write_locked(SeverityPrefixes[size_t(sev)],
+                         strlen(SeverityPrefixes[size_t(sev)]));
+            if (at) {
+                format_locked("%s:%u:%u: ", at->file, at->line, at->column);
+            }
+            vformat_locked(fmt, args);
+            literal_locked("\n");
+            return;
+        }
+
+        // the message has to be escaped, so it is formatted on its own
+        char local[512];
+        va_list copy;
+        va_copy(copy, args);
+        int n = std::max(vsnprintf(local, sizeof(local), fmt, copy), 0);
+        va_end(copy);
+        std::vector<char> big;
+        const char* message = local;
+        if (size_t(n) >= sizeof(local)) {
+            big.resize(n + 1);
+            vsnprintf(big.data(), big.size(), fmt, args);
+            message = big.data();
+        }
 
-        last_char = getchar();
-        while (isdigit(last_char) || last_char == '.') {
-            numstr += last_char;
-            last_char = getchar();
+        format_locked("{\"severity\": \"%s\"", SeverityNames[size_t(sev)]);
+        if (at) {
+            literal_locked(", \"file\": ");
+            json_string_locked(at->file, strlen(at->file));
+            format_locked(", \"line\": %u, \"column\": %u", at->line,
+                          at->column);
         }
-        NumVal = strtod(numstr.c_str(), nullptr);
-        return tok_num;
+        literal_locked(", \"message\": ");
+        json_string_locked(message, n);
+        literal_locked("}\n");
+    }
+
+public:
+    explicit DiagnosticEngine(FILE* out) : out(out) {}
+
+    DiagnosticEngine(const DiagnosticEngine&) = delete;
+    DiagnosticEngine& operator=(const DiagnosticEngine&) = delete;
+
+    ~DiagnosticEngine() { flush(); }
+
+    // whether a diagnostic of sev is written at all, so callers can skip
+    // working out what it would say
+    bool wants(Severity sev) const {
+        return !(QuietOutput && sev == Severity::Note);
+    }
+
+    void report(Severity sev, const SourceLocation* at, const char* fmt,
+                ...) __attribute__((format(printf, 4, 5))) {
+        va_list args;
+        va_start(args, fmt);
+        vreport(sev, at, fmt, args);
+        va_end(args);
     }
 
-    // TODO: handle comments
+    void error(const char* fmt, ...) __attribute__((format(printf, 2, 3))) {
+        va_list args;
+        va_start(args, fmt);
+        vreport(Severity::Error, nullptr, fmt, args);
+        va_end(args);
+    }
 
-    if (last_char == EOF) {
-        return tok_eof;
+    void note(const char* fmt, ...) __attribute__((format(printf, 2, 3))) {
+        va_list args;
+        va_start(args, fmt);
+        vreport(Severity::Note, nullptr, fmt, args);
+        va_end(args);
     }
 
-    char this_char = last_char;
-    last_char = getchar();
-    return this_char;
-}
+    // output that is not a diagnostic, kept in order with them
+    void print(const char* fmt, ...) __attribute__((format(printf, 2, 3))) {
+        va_list args;
+        va_start(args, fmt);
+        std::lock_guard<std::mutex> lock(mutex);
+        vformat_locked(fmt, args);
+        va_end(args);
+    }
 
-bool is_op(char op) {
-    return (op == '+') || (op == '-') || (op == '*') ? true : false;
+    void write(const char* p, size_t n) {
+        std::lock_guard<std::mutex> lock(mutex);
+        write_locked(p, n);
+    }
+
+    void flush() {
+        std::lock_guard<std::mutex> lock(mutex);
+        flush_locked();
+    }
+
+    size_t count(Severity sev) const { return counts[size_t(sev)]; }
+};
+
+// what goes to stderr, from any thread
+static DiagnosticEngine& stderr_output() {
+    static DiagnosticEngine engine(stderr);
+    return engine;
 }
 
+// lets LLVM print, e.g. IR, into an engine. unbuffered, the engine buffers.
+class DiagnosticStream : public llvm::raw_ostream {
+    DiagnosticEngine& engine;
 
-/////////
-/* AST */
-/////////
+    uint64_t pos = 0;
+
+    void write_impl(const char* p, size_t n) override {
+        engine.write(p, n);
+        pos += n;
+    }
+    uint64_t current_pos() const override { return pos; }
 
-class Expr {
 public:
-    virtual ~Expr() = default;
+    explicit DiagnosticStream(DiagnosticEngine& engine)
+        : raw_ostream(true), engine(engine) {}
 };
 
-class NumExpr : public Expr {
-    double val;
 
-public:
-    NumExpr(double val) : val(val) {}
+///////////
+/* STATS */
+///////////
+
+// per phase timers and counters for --stats, and events for --time-trace.
+// a PhaseScope charges the wall and cpu time and the bytes allocated while
+// it is open to its phase, minus whatever scopes nested in it charge to
+// theirs, so however phases nest each moment is counted once. every thread
+// keeps totals of its own, which are added up when it exits. with both
+// flags off a scope costs a branch. build with -DKALEIDOSCOPE_NO_STATS to
+// leave all of it out.
+
+enum class Phase : uint8_t {
+    Lex,
+    Parse,
+    Codegen,
+    Optimize,
+    JitLink,
+    Execute,
+    Emit,
 };
 
-class VarExpr : public Expr {
-    std::string name;
+static constexpr size_t phase_count = 7;
 
-public:
-    VarExpr(std::string &name) : name(name) {}
+static const char* const PhaseNames[phase_count] = {
+    "lex", "parse", "codegen", "optimize", "jit_link", "execute", "emit",
 };
 
-class BinaryExpr : public Expr {
-    char op;
-    std::unique_ptr<Expr> lhs, rhs;
+static bool StatsEnabled = false;
+static bool TimeTraceEnabled = false;
 
-public:
-    BinaryExpr(char op, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
-        : op(op), lhs(std::move(lhs)), rhs(std::move(rhs)) {}
+// events shorter than this many microseconds are left out of the trace
+static unsigned TimeTraceGranularity = 100;
+
+struct PhaseTotals {
+    uint64_t wall_ns = 0;
+    uint64_t cpu_ns = 0;
+    uint64_t bytes = 0;
+    uint64_t scopes = 0;
 };
 
-class CallExpr : public Expr {
-    std::string callee;
-    std::vector<std::unique_ptr<Expr>> args;
+struct StatsCounters {
+    PhaseTotals phases[phase_count];
+    uint64_t tokens = 0;
+    uint64_t ast_nodes = 0;
+    // most bytes held by an AstContext at once
+    uint64_t arena_high_water = 0;
 
-public:
-    CallExpr(std::string callee, std::vector<std::unique_ptr<Expr>> args)
-        : callee(callee), args(std::move(args)) {}
+    void merge(const StatsCounters& other) {
+        for (size_t i = 0; i < phase_count; i++) {
+            phases[i].wall_ns += other.phases[i].wall_ns;
+            phases[i].cpu_ns += other.phases[i].cpu_ns;
+            phases[i].bytes += other.phases[i].bytes;
+            phases[i].scopes += other.phases[i].scopes;
+        }
+        tokens += other.tokens;
+        ast_nodes += other.ast_nodes;
+        arena_high_water = std::max(arena_high_water, other.arena_high_water);
+    }
 };
 
+#ifndef KALEIDOSCOPE_NO_STATS
 
-class FuncPrototype {
-    std::string name;
-    std::vector<std::unique_ptr<Expr>> args;
+// totals of the threads that have exited
+static std::mutex StatsMutex;
+static StatsCounters StatsExited;
 
-public:
-    FuncPrototype(std::string name, std::vector<std::unique_ptr<Expr>> args)
-        : name(name), args(std::move(args)) {}
+struct ThreadStats : StatsCounters {
+    ~ThreadStats() {
+        std::lock_guard<std::mutex> lock(StatsMutex);
+        StatsExited.merge(*this);
+    }
 };
 
-class FunctionExpr : public Expr {
-    std::unique_ptr<FuncPrototype> proto;
-    std::unique_ptr<Expr> body;
+static ThreadStats& thread_stats() {
+    static thread_local ThreadStats stats;
+    return stats;
+}
 
-public:
-    FunctionExpr(std::unique_ptr<FuncPrototype> proto,
-                 std::unique_ptr<Expr> body)
-        : proto(std::move(proto)), body(std::move(body)) {}
-};
+// bytes the calling thread has asked operator new for, which LLVM goes
+// through as well. trivially initialized, so counting is just the add.
+static thread_local uint64_t ThreadAllocated = 0;
+
+// as the standard asks of a replacement: retries after each call of the
+// new_handler, then throws. llvm-config builds this file without
+// exceptions, where libstdc++'s out of line __throw_bad_alloc still throws,
+// so the nothrow new, which calls this one, gets to return nullptr.
+void* operator new(size_t size) {
+    ThreadAllocated += size;
+    while (true) {
+        if (void* p = malloc(size ? size : 1)) {
+            return p;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) {
+            break;
+        }
+        handler();
+    }
+#if __cpp_exceptions
+    throw std::bad_alloc();
+#else
+    std::__throw_bad_alloc();
+#endif
+}
 
-static int CurTok;
-static int get_next_token() {
-    return CurTok = gettok();
+// kept out of line, gcc warns about free() on memory from operator new
+// wherever these are inlined
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    free(p);
+}
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+    free(p);
 }
 
-std::unique_ptr<Expr> log_error(const char* str) {
-    fprintf(stderr, "Error: %s\n", str);
-    print_curtok();
-    return nullptr;
+static uint64_t stats_wall_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
-std::unique_ptr<FuncPrototype> log_error_p(const char* str) {
-    log_error(str);
-    return nullptr;
+static uint64_t stats_cpu_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
 }
 
+class PhaseScope {
+    static inline thread_local PhaseScope* current = nullptr;
 
-static std::unique_ptr<Expr> parse_expr();
+    llvm::TimeTraceScope trace;
+    Phase phase;
+    bool active;
+    PhaseScope* parent = nullptr;
+    uint64_t wall = 0;
+    uint64_t cpu = 0;
+    uint64_t bytes = 0;
 
-static std::unique_ptr<Expr> parse_ident() {
-    std::string name = IdentStr;
-    get_next_token();
+    // charged by the scopes nested in this one
+    uint64_t nested_wall = 0;
+    uint64_t nested_cpu = 0;
+    uint64_t nested_bytes = 0;
 
-    // if the name is followed by parentheses then it is a function call
-    if (CurTok != '(') {
-        return std::make_unique<VarExpr>(name);
+public:
+    explicit PhaseScope(Phase phase)
+        : trace(PhaseNames[size_t(phase)]),
+          phase(phase),
+          active(StatsEnabled) {
+        if (!active) {
+            return;
+        }
+        parent = std::exchange(current, this);
+        wall = stats_wall_ns();
+        cpu = stats_cpu_ns();
+        bytes = ThreadAllocated;
     }
 
-    std::vector<std::unique_ptr<Expr>> args;
-    get_next_token(); // eat '('
+    PhaseScope(const PhaseScope&) = delete;
+    PhaseScope& operator=(const PhaseScope&) = delete;
 
-    if (CurTok != ')') {
-        while (true) {
-            if (auto arg = parse_expr()) {
-                args.push_back(std::move(arg));
-            } else {
-                return log_error("failed to parse argument");
-            }
+    ~PhaseScope() {
+        if (!active) {
+            return;
+        }
+        uint64_t d_wall = stats_wall_ns() - wall;
+        uint64_t d_cpu = stats_cpu_ns() - cpu;
+        uint64_t d_bytes = ThreadAllocated - bytes;
 
-            if (CurTok == ')') {
-                break;
-            }
-            if (CurTok != ',') {
-                return log_error("expected ',' or ')' in argument list");
-            }
+        PhaseTotals& totals = thread_stats().phases[size_t(phase)];
+        totals.wall_ns += d_wall - std::min(nested_wall, d_wall);
+        totals.cpu_ns += d_cpu - std::min(nested_cpu, d_cpu);
+        totals.bytes += d_bytes - std::min(nested_bytes, d_bytes);
+        ++totals.scopes;
 
-            get_next_token();
+        current = parent;
+        if (parent) {
+            parent->nested_wall += d_wall;
+            parent->nested_cpu += d_cpu;
+            parent->nested_bytes += d_bytes;
         }
-        get_next_token(); // eat the ')'
     }
 
-    return std::make_unique<CallExpr>(name, std::move(args));
-}
+    // tokens are timed one by one on the wall clock only, reading the cpu
+    // clock costs more than lexing a token. their cpu time and whatever
+    // the lexer allocates stay with the enclosing phase.
+    template <typename F>
+    static auto lex_token(F lex) {
+        if (!StatsEnabled) {
+            return lex();
+        }
+        uint64_t start = stats_wall_ns();
+        auto tok = lex();
+        uint64_t ns = stats_wall_ns() - start;
+
+        ThreadStats& stats = thread_stats();
+        ++stats.tokens;
+        stats.phases[size_t(Phase::Lex)].wall_ns += ns;
+        ++stats.phases[size_t(Phase::Lex)].scopes;
+        if (current) {
+            current->nested_wall += ns;
+        }
+        return tok;
+    }
+};
 
-static std::unique_ptr<NumExpr> parse_number() {
-    auto result = std::make_unique<NumExpr>(NumVal);
-    get_next_token(); // eat the number
-    return result;
+static void stats_add_nodes(uint64_t nodes) {
+    if (StatsEnabled) {
+        thread_stats().ast_nodes += nodes;
+    }
 }
 
-static std::unique_ptr<Expr> parse_primary() {
-    switch (CurTok) {
-        case tok_ident:
-            return parse_ident();
-        case tok_num:
-            return parse_number();
-        default:
-            return log_error("unknown token type");
+static void stats_arena_size(uint64_t bytes) {
+    if (StatsEnabled) {
+        uint64_t& high = thread_stats().arena_high_water;
+        high = std::max(high, bytes);
     }
 }
 
-// of the form
-//      '+' primary
-static std::unique_ptr<Expr> parse_binop_rhs(std::unique_ptr<Expr> lhs) {
-    std::unique_ptr<Expr> cur = std::move(lhs);
-    while (true) {
-        int op = CurTok;
-        if (!is_op(op)) {
-            return cur;
+// a thread other than the main one only records trace events inside one
+// of these, LLVM's profiler is per thread
+class ThreadTraceScope {
+public:
+    ThreadTraceScope() {
+        if (TimeTraceEnabled) {
+            llvm::timeTraceProfilerInitialize(TimeTraceGranularity, "parser");
         }
-
-        get_next_token(); // eat the op (only if it is a valid op)
-
-        auto rhs = parse_primary();
-        if (!rhs) {
-            return log_error(
-                    "could not parse right hand side of binary expression");
+    }
+    ~ThreadTraceScope() {
+        if (TimeTraceEnabled) {
+            llvm::timeTraceProfilerFinishThread();
         }
+    }
+};
 
-        // assuming all ops be left associative
-        cur = std::make_unique<BinaryExpr>(op, std::move(cur), std::move(rhs));
+// the totals of every thread so far, the calling one included. call once
+// the other threads are done.
+static StatsCounters stats_collect() {
+    StatsCounters all;
+    {
+        std::lock_guard<std::mutex> lock(StatsMutex);
+        all = StatsExited;
     }
+    all.merge(thread_stats());
+    return all;
 }
 
-static std::unique_ptr<Expr> parse_expr() {
-    auto lhs = parse_primary();
-    if (!lhs) {
-        return nullptr;
-    }
+#else
 
-    return parse_binop_rhs(std::move(lhs));
-}
+class PhaseScope {
+public:
+    explicit PhaseScope(Phase) {}
+    ~PhaseScope() {}
 
-static std::unique_ptr<FuncPrototype> parse_prototype() {
-    if (CurTok != tok_ident) {
-        return log_error_p("expected function name");
+    template <typename F>
+    static auto lex_token(F lex) {
+        return lex();
     }
+};
+
+static void stats_add_nodes(uint64_t) {}
+static void stats_arena_size(uint64_t) {}
 
-    std::string name = IdentStr;
-    get_next_token(); // eat name
+class ThreadTraceScope {
+public:
+    ThreadTraceScope() {}
+    ~ThreadTraceScope() {}
+};
+
+static StatsCounters stats_collect() { return StatsCounters(); }
+
+#endif
 
-    if (CurTok != '(') {
-        return log_error_p("expected (");
+static void stats_print(const StatsCounters& s) {
+    fprintf(stderr, "%-10s %12s %12s %14s %10s\n", "phase", "wall ms",
+            "cpu ms", "allocated", "scopes");
+    for (size_t i = 0; i < phase_count; i++) {
+        const PhaseTotals& p = s.phases[i];
+        if (Phase(i) == Phase::Lex) {
+            fprintf(stderr, "%-10s %12.3f %12s %14s %10llu\n", PhaseNames[i],
+                    p.wall_ns / 1e6, "-", "-",
+                    static_cast<unsigned long long>(p.scopes));
+            continue;
+        }
+        fprintf(stderr, "%-10s %12.3f %12.3f %14llu %10llu\n", PhaseNames[i],
+                p.wall_ns / 1e6, p.cpu_ns / 1e6,
+                static_cast<unsigned long long>(p.bytes),
+                static_cast<unsigned long long>(p.scopes));
     }
+    fprintf(stderr, "tokens: %llu, ast nodes: %llu, arena high water: %llu "
+            "bytes\n", static_cast<unsigned long long>(s.tokens),
+            static_cast<unsigned long long>(s.ast_nodes),
+            static_cast<unsigned long long>(s.arena_high_water));
+}
 
-    // TODO: check whether all these args are idents
-    std::vector<std::unique_ptr<Expr>> argnames;
-    get_next_token(); // eat '('
+static void stats_write_json(const StatsCounters& s, FILE* out) {
+    fprintf(out, "{\"phases\": {");
+    for (size_t i = 0; i < phase_count; i++) {
+        const PhaseTotals& p = s.phases[i];
+        fprintf(out, "%s\"%s\": {\"wall_ns\": %llu, \"cpu_ns\": %llu, "
+                "\"bytes\": %llu, \"scopes\": %llu}", i ? ", " : "",
+                PhaseNames[i], static_cast<unsigned long long>(p.wall_ns),
+                static_cast<unsigned long long>(p.cpu_ns),
+                static_cast<unsigned long long>(p.bytes),
+                static_cast<unsigned long long>(p.scopes));
+    }
+    fprintf(out, "}, \"tokens\": %llu, \"ast_nodes\": %llu, "
+            "\"arena_high_water\": %llu}\n",
+            static_cast<unsigned long long>(s.tokens),
+            static_cast<unsigned long long>(s.ast_nodes),
+            static_cast<unsigned long long>(s.arena_high_water));
+}
 
-    if (CurTok != ')') {
-        while (true) {
-            if (auto aname = parse_ident()) {
-                argnames.push_back(std::move(aname));
-            } else {
-                char buffer[100];
-                std::sprintf(buffer,
-                        "in argument list in function prototype\n"
-                        "expected identifier. found %c",
-                        CurTok);
-                return log_error_p(buffer);
-            }
+// what main asked for, done when it returns and every other thread is gone
+struct StatsReport {
+    bool print = false;
+    const char* json_path = nullptr;
+    const char* trace_path = nullptr;
 
-            if (CurTok == ')') {
-                break;
+    ~StatsReport() {
+        stderr_output().flush();
+        if (print || json_path) {
+            StatsCounters s = stats_collect();
+            if (print) {
+                stats_print(s);
             }
-            if (CurTok != ',') {
-                return log_error_p("expected ',' or ')' in argument list");
+            if (json_path) {
+                bool to_stdout = strcmp(json_path, "-") == 0;
+                FILE* out = to_stdout ? stdout : fopen(json_path, "w");
+                if (out) {
+                    stats_write_json(s, out);
+                    if (!to_stdout) {
+                        fclose(out);
+                    }
+                } else {
+                    fprintf(stderr, "Error: could not open %s: %s\n",
+                            json_path, strerror(errno));
+                }
             }
+        }
 
-            get_next_token();
+        if (trace_path) {
+            std::error_code ec;
+            llvm::raw_fd_ostream out(trace_path, ec, llvm::sys::fs::OF_Text);
+            if (ec) {
+                fprintf(stderr, "Error: could not open %s: %s\n", trace_path,
+                        ec.message().c_str());
+            } else {
+                llvm::timeTraceProfilerWrite(out);
+            }
+            llvm::timeTraceProfilerCleanup();
         }
-        get_next_token(); // eat the ')'
     }
+};
 
-    return std::make_unique<FuncPrototype>(name, std::move(argnames));
-}
 
-// definition ::=
-//      'def' proto expr
-static std::unique_ptr<Expr> parse_definition() {
-    get_next_token(); // eat the 'def'
-    auto proto = parse_prototype();
-    if (!proto) {
-        return nullptr;
-    }
+//////////////////
+/* INPUT SOURCE */
+//////////////////
 
-    auto body = parse_expr();
-    if (!body) {
-        return log_error("expected function body");
-    }
-    return std::make_unique<FunctionExpr>(std::move(proto), std::move(body));
-}
+// the lexer scans a contiguous buffer that is always followed by a '\0'
+// sentinel, so the scanning loops don't need a bounds check per byte. when
+// the sentinel is reached at the end of the buffer the lexer asks the source
+// for more input with fill().
+class InputSource {
+protected:
+    const char* buf = "";
+    size_t len = 0;
+
+public:
+    virtual ~InputSource() = default;
+
+    // makes more input available. the buffer may move, so callers have to
+    // rebase any pointers into it. returns false at end of input.
+    virtual bool fill() = 0;
+
+    const char* data() const { return buf; }
+    const char* end() const { return buf + len; }
+    size_t size() const { return len; }
+};
 
-static std::unique_ptr<Expr> parse_toplevel_expr() {
-    if (auto e = parse_expr()) {
-        auto proto = std::make_unique<FuncPrototype>(
-                std::string("__anon_expr"),
-                std::vector<std::unique_ptr<Expr>>()
-        );
-        return std::make_unique<FunctionExpr>(std::move(proto), std::move(e));
+// whole file mapped into memory. the tail of the last page past the end of
+// the file is zero filled by the kernel which gives us the sentinel for free.
+// if the file size is an exact multiple of the page size there is no tail,
+// so the file is read into a buffer instead.
+class MappedFileSource : public InputSource {
+    void* map = MAP_FAILED;
+    size_t map_len = 0;
+    std::vector<char> copy;
+    bool oversized = false;
+
+public:
+    ~MappedFileSource() override {
+        if (map != MAP_FAILED) {
+            munmap(map, map_len);
+        }
     }
-    return nullptr;
-}
 
-static std::unique_ptr<FuncPrototype> parse_extern() {
-    get_next_token(); // eat the 'extern'
-    return parse_prototype();
-}
+    bool open(const char* path) {
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
 
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            close(fd);
+            return false;
+        }
 
-////////////////////
-// top level parsing
-////////////////////
+        size_t size = st.st_size;
+        size_t page = sysconf(_SC_PAGESIZE);
+        if (size > UINT32_MAX) {
+            // token spans are 32 bit offsets
+            oversized = true;
+            close(fd);
+            return false;
+        }
+        if (size == 0) {
+            close(fd);
+            return true;
+        }
 
-static void handle_definition() {
-    if (parse_definition()) {
-    } else {
-        get_next_token();
+        if (size % page != 0) {
+            map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+
+        if (map != MAP_FAILED) {
+            map_len = size;
+            madvise(map, map_len, MADV_SEQUENTIAL);
+            buf = static_cast<const char*>(map);
+        } else {
+            copy.resize(size + 1);
+            size_t done = 0;
+            while (done < size) {
+                ssize_t n = read(fd, copy.data() + done, size - done);
+                if (n <= 0) {
+                    break;
+                }
+                done += n;
+            }
+            size = done;
+            copy[size] = '\0';
+            buf = copy.data();
+        }
+        len = size;
+
+        close(fd);
+        return true;
     }
-}
 
-static void handle_toplevel_expr() {
-    if (parse_toplevel_expr()) {
-        fprintf(stderr, "parsed top level expression\n");
-    } else {
-        get_next_token();
+    bool fill() override {
+        return false;
     }
-}
 
-static void handle_extern() {
-    if (parse_extern()) {
-        fprintf(stderr, "parsed extern\n");
+    // whether open() failed because the file is over 4 GiB
+    bool too_large() const { return oversized; }
+};
+
+// why file could not open path
+static void report_open_error(const MappedFileSource& file, const char* path) {
+    if (file.too_large()) {
+        stderr_output().error("%s is too large, inputs are limited to 4 GiB",
+                              path);
     } else {
-        get_next_token();
+        stderr_output().error("could not open %s", path);
     }
 }
 
+// a buffer already in memory
+class MemorySource : public InputSource {
+    std::string text;
 
-static void main_loop() {
-    while (true) {
-        printf("ready> ");
-        get_next_token();
-        switch (CurTok) {
-            case tok_eof:
-                return;
+public:
+    MemorySource(std::string src) : text(std::move(src)) {
+        // std::string keeps a '\0' after its contents
+        buf = text.data();
+        len = text.size();
+    }
 
-            case ';':
-                //get_next_token(); // eat the ';'
-                break;
+    bool fill() override {
+        return false;
+    }
+};
 
-            case tok_def:
-                handle_definition();
-                break;
+// stdin read in large blocks with read(2). everything read so far is kept in
+// the buffer so tokens can keep referring to it. a read on a terminal returns
+// after each line so the repl still works interactively.
+class BufferedStdinSource : public InputSource {
+    static constexpr size_t block_size = 64 * 1024;
 
-            case tok_extern:
-                handle_extern();
-                break;
+    std::vector<char> storage = std::vector<char>(1, '\0');
+    bool at_eof = false;
 
-            default:
-                handle_toplevel_expr();
-                break;
+public:
+    bool fill() override {
+        if (at_eof) {
+            return false;
+        }
+
+        // the prompt, and what came before it, has to be visible before we
+        // block on the read
+        stderr_output().flush();
+        fflush(stdout);
+
+        // token spans are 32 bit offsets, as for MappedFileSource
+        size_t room = std::min<size_t>(block_size, UINT32_MAX - len);
+        if (room == 0) {
+            stderr_output().error("stdin is too large, inputs are limited to "
+                                  "4 GiB");
+            at_eof = true;
+            return false;
         }
+
+        storage.resize(len + room + 1);
+        ssize_t n;
+        do {
+            n = read(STDIN_FILENO, storage.data() + len, room);
+        } while (n < 0 && errno == EINTR);
+
+        if (n <= 0) {
+            at_eof = true;
+            n = 0;
+        }
+
+        len += n;
+        storage[len] = '\0';
+        buf = storage.data();
+        return n > 0;
     }
-}
+};
 
-static void print_curtok() {
-    switch (CurTok) {
-        case tok_def:
-            printf("token type: def\n");
-            return;
-        case tok_extern:
-            printf("token type: extern\n");
-            return;
-        case tok_ident:
-            printf("token type: ident. %s\n", IdentStr.c_str());
-            return;
-        case tok_num:
-            printf("token type: number. %d\n", NumVal);
-            return;
-        case tok_eof:
-            printf("token type: eof\n");
-            return;
-        default:
-            printf("unknown token type: %c\n", CurTok);
-            return;
+
+//////////////////
+/* SYMBOL TABLE */
+//////////////////
+
+// every distinct identifier gets a dense id, so the lexer compares keywords
+// by id and the AST and codegen can index arrays by name instead of hashing
+// strings.
+using SymbolId = uint32_t;
+
+// interned up front in this order by the SymbolTable constructor
+enum : SymbolId {
+    sym_def,
+    sym_extern,
+    sym_anon_expr,
+};
+
+class SymbolTable {
+    static constexpr size_t chunk_size = 64 * 1024;
+
+    // names are copied into chunks that are never reallocated, so the views
+    // in names and index stay valid as the table grows
+    std::vector<std::unique_ptr<char[]>> chunks;
+    size_t chunk_used = chunk_size;
+
+    std::vector<std::string_view> names;
+    std::unordered_map<std::string_view, SymbolId> index;
+
+    std::string_view store(std::string_view name) {
+        if (name.size() > chunk_size / 4) {
+            // long names get a chunk of their own at the front so the last
+            // chunk stays the one being filled
+            auto big = chunks.emplace(chunks.begin(), new char[name.size()]);
+            memcpy(big->get(), name.data(), name.size());
+            return std::string_view(big->get(), name.size());
+        }
+        if (chunk_size - chunk_used < name.size()) {
+            chunks.emplace_back(new char[chunk_size]);
+            chunk_used = 0;
+        }
+        char* dst = chunks.back().get() + chunk_used;
+        memcpy(dst, name.data(), name.size());
+        chunk_used += name.size();
+        return std::string_view(dst, name.size());
     }
-}
 
-int main() {
+public:
+    SymbolTable() {
+        index.reserve(1024);
+        intern("def");
+        intern("extern");
+        intern("__anon_expr");
+    }
 
-    /*
-    while (CurTok != tok_eof) {
-        print_curtok();
-        get_next_token();
+    SymbolId intern(std::string_view name) {
+        auto it = index.find(name);
+        if (it != index.end()) {
+            return it->second;
+        }
+        std::string_view stored = store(name);
+        SymbolId id = names.size();
+        names.push_back(stored);
+        index.emplace(stored, id);
+        return id;
+    }
+
+    std::string_view name(SymbolId id) const {
+        return names[id];
     }
-    */
 
-    main_loop();
+    size_t size() const {
+        return names.size();
+    }
+};
 
-    return 0;
+
+///////////////////////
+/* CHARACTER CLASSES */
+///////////////////////
+
+// the lexer classifies chars through this table instead of the locale
+// dependent <cctype> functions. runs of one class are skipped a block at a
+// time with SSE2 or AVX2 (whichever the build targets) or NEON, and a byte
+// at a time otherwise. build with -DKALEIDOSCOPE_SCALAR_LEX to force the
+// byte at a time reference version.
+
+enum : uint8_t {
+    cc_space = 1 << 0,  // ' ' \t \n \v \f \r
+    cc_alpha = 1 << 1,
+    cc_digit = 1 << 2,
+    cc_dot = 1 << 3,
+
+    cc_alnum = cc_alpha | cc_digit,
+    cc_number = cc_digit | cc_dot,
+};
+
+static const std::array<uint8_t, 256> CharClass = [] {
+    std::array<uint8_t, 256> table{};
+    table[' '] = cc_space;
+    for (int c = '\t'; c <= '\r'; c++) {
+        table[c] = cc_space;
+    }
+    for (int c = 'a'; c <= 'z'; c++) {
+        table[c] = cc_alpha;
+        table[c - 'a' + 'A'] = cc_alpha;
+    }
+    for (int c = '0'; c <= '9'; c++) {
+        table[c] = cc_digit;
+    }
+    table['.'] = cc_dot;
+    return table;
+}();
+
+static inline bool char_is(char c, uint8_t cls) {
+    return CharClass[static_cast<unsigned char>(c)] & cls;
+}
+
+#if !defined(KALEIDOSCOPE_SCALAR_LEX) && defined(__AVX2__)
+
+static constexpr size_t scan_block = 32;
+
+// bit i set if byte i of the block at p is in Cls
+template <uint8_t Cls>
+static inline uint32_t class_mask(const char* p) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    // signed compares, bytes >= 0x80 are negative and never in range
+    auto in_range = [](__m256i v, char lo, char hi) {
+        return _mm256_and_si256(
+                _mm256_cmpgt_epi8(v, _mm256_set1_epi8(lo - 1)),
+                _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), v));
+    };
+    __m256i m = _mm256_setzero_si256();
+    if (Cls & cc_space) {
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+        m = _mm256_or_si256(m, in_range(v, '\t', '\r'));
+    }
+    if (Cls & cc_alpha) {
+        __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+        m = _mm256_or_si256(m, in_range(lower, 'a', 'z'));
+    }
+    if (Cls & cc_digit) {
+        m = _mm256_or_si256(m, in_range(v, '0', '9'));
+    }
+    if (Cls & cc_dot) {
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('.')));
+    }
+    return _mm256_movemask_epi8(m);
+}
+
+// index of the first byte of the block not in the class, scan_block if all
+// of them are
+template <uint8_t Cls>
+static inline size_t class_run(const char* p) {
+    uint32_t outside = ~class_mask<Cls>(p);
+    return outside ? __builtin_ctz(outside) : scan_block;
+}
+
+#elif !defined(KALEIDOSCOPE_SCALAR_LEX) && defined(__SSE2__)
+
+static constexpr size_t scan_block = 16;
+
+template <uint8_t Cls>
+static inline uint32_t class_mask(const char* p) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    // signed compares, bytes >= 0x80 are negative and never in range
+    auto in_range = [](__m128i v, char lo, char hi) {
+        return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+                             _mm_cmpgt_epi8(_mm_set1_epi8(hi + 1), v));
+    };
+    __m128i m = _mm_setzero_si128();
+    if (Cls & cc_space) {
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+        m = _mm_or_si128(m, in_range(v, '\t', '\r'));
+    }
+    if (Cls & cc_alpha) {
+        __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        m = _mm_or_si128(m, in_range(lower, 'a', 'z'));
+    }
+    if (Cls & cc_digit) {
+        m = _mm_or_si128(m, in_range(v, '0', '9'));
+    }
+    if (Cls & cc_dot) {
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('.')));
+    }
+    return _mm_movemask_epi8(m);
+}
+
+template <uint8_t Cls>
+static inline size_t class_run(const char* p) {
+    uint32_t outside = ~class_mask<Cls>(p) & 0xffff;
+    return outside ? __builtin_ctz(outside) : scan_block;
+}
+
+#elif !defined(KALEIDOSCOPE_SCALAR_LEX) && defined(__ARM_NEON)
+
+static constexpr size_t scan_block = 16;
+
+template <uint8_t Cls>
+static inline size_t class_run(const char* p) {
+    uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+    auto in_range = [](uint8x16_t v, uint8_t lo, uint8_t hi) {
+        return vandq_u8(vcgeq_u8(v, vdupq_n_u8(lo)),
+                        vcleq_u8(v, vdupq_n_u8(hi)));
+    };
+    uint8x16_t m = vdupq_n_u8(0);
+    if (Cls & cc_space) {
+        m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8(' ')));
+        m = vorrq_u8(m, in_range(v, '\t', '\r'));
+    }
+    if (Cls & cc_alpha) {
+        m = vorrq_u8(m, in_range(vorrq_u8(v, vdupq_n_u8(0x20)), 'a', 'z'));
+    }
+    if (Cls & cc_digit) {
+        m = vorrq_u8(m, in_range(v, '0', '9'));
+    }
+    if (Cls & cc_dot) {
+        m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('.')));
+    }
+    // no movemask on neon. narrowing by 4 leaves a nibble per byte
+    uint64_t nibbles = vget_lane_u64(vreinterpret_u64_u8(
+            vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+    uint64_t outside = ~nibbles;
+    return outside ? __builtin_ctzll(outside) / 4 : scan_block;
+}
+
+#else
+
+static constexpr size_t scan_block = 0;
+
+#endif
+
+// returns the first char at or after p that is not in Cls. stops at the
+// '\0' sentinel at end at the latest since it has no class.
+template <uint8_t Cls>
+static inline const char* skip_class(const char* p, const char* end) {
+#if !defined(KALEIDOSCOPE_SCALAR_LEX) \
+        && (defined(__SSE2__) || defined(__ARM_NEON))
+    // most runs are a single space or a short name, which the table gets
+    // through quicker than setting up a block compare
+    for (int i = 0; i < 8; i++) {
+        if (!char_is(*p, Cls)) {
+            return p;
+        }
+        ++p;
+    }
+
+    // only whole blocks before end, so a load never crosses into a page
+    // that might not be mapped
+    while (static_cast<size_t>(end - p) >= scan_block) {
+        size_t n = class_run<Cls>(p);
+        p += n;
+        if (n < scan_block) {
+            return p;
+        }
+    }
+#else
+    (void)end;
+#endif
+    while (char_is(*p, Cls)) {
+        ++p;
+    }
+    return p;
+}
+
+
+///////////
+/* LEXER */
+///////////
+
+enum TokenKind {
+    tok_eof = -1,
+
+    tok_def = -2,
+    tok_extern = -3,
+
+    tok_ident = -4,
+    tok_num = -5,
+
+    // malformed token, reported by the parser
+    tok_error = -6,
+};
+
+// where a token is in the input buffer. an offset rather than a pointer
+// because the stdin buffer can move when it is refilled.
+struct SourceSpan {
+    uint32_t offset = 0;
+    uint32_t length = 0;
+};
+
+// a lexed token with what the parser needs of it, so it can be handed on
+// without the lexer that made it
+struct Token {
+    // a TokenKind, or the char itself for anything else
+    int32_t kind = tok_eof;
+    SourceSpan span;
+    union {
+        // of tok_num
+        double num = 0;
+        // of tok_ident, tok_def and tok_extern
+        SymbolId sym;
+    };
+};
+
+// exact powers of ten as doubles
+static const double Pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// parses digits with at most one '.' and at least one digit, correctly
+// rounded and independent of the locale. false if the literal is malformed.
+static bool parse_number_literal(const char* p, const char* end,
+                                 double* out) {
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int frac_digits = 0;
+    bool seen_dot = false;
+
+    for (const char* c = p; c != end; c++) {
+        if (*c == '.') {
+            if (seen_dot) {
+                return false;
+            }
+            seen_dot = true;
+            continue;
+        }
+        // leading zeros don't use up any precision
+        if (digits > 0 || *c != '0') {
+            ++digits;
+        }
+        mantissa = mantissa * 10 + (*c - '0');
+        frac_digits += seen_dot;
+    }
+
+    if (end - p == seen_dot) {
+        return false;
+    }
+
+    // when the mantissa and the power of ten are both exact doubles a
+    // single multiply or divide rounds correctly
+    if (digits <= 19 && mantissa <= (uint64_t(1) << 53) && frac_digits <= 22) {
+        *out = static_cast<double>(mantissa) / Pow10[frac_digits];
+        return true;
+    }
+
+    // too many digits for that, leave it to the library which handles the
+    // general case exactly
+    auto result = std::from_chars(p, end, *out, std::chars_format::fixed);
+    if (result.ptr != end) {
+        return false;
+    }
+    // from_chars leaves *out alone for these, strtod gives inf for too
+    // large and 0 for too small, which a nonzero digit before the '.' tells
+    // apart
+    if (result.ec == std::errc::result_out_of_range) {
+        const char* c = p;
+        while (c != end && *c == '0') {
+            c++;
+        }
+        bool large = c != end && *c != '.';
+        *out = large ? HUGE_VAL : 0.0;
+        return true;
+    }
+    return result.ec == std::errc();
+}
+
+// turns an InputSource into tokens. all of its state is per instance, so
+// any number of lexers can run at once as long as each has its own input
+// and symbol table.
+class Lexer {
+    InputSource* input;
+    const char* cur;
+    SymbolTable& symbols;
+
+    // called when the scan hits a '\0'. returns true if more input is
+    // available at cur, false if cur is at the end of the input for good. a
+    // '\0' in the middle of the buffer is not the sentinel and is left to
+    // the caller.
+    bool refill() {
+        if (cur != input->end()) {
+            return true;
+        }
+        size_t off = cur - input->data();
+        bool more = input->fill();
+        cur = input->data() + off;
+        return more;
+    }
+
+    bool at_sentinel() const {
+        return *cur == '\0' && cur == input->end();
+    }
+
+    // advance cur past every char in Cls, pulling in more input if the run
+    // reaches the end of the buffer. returns the offset the run started at
+    // since the buffer may move while scanning.
+    template <uint8_t Cls>
+    size_t scan_class() {
+        size_t start = cur - input->data();
+        while (true) {
+            cur = skip_class<Cls>(cur, input->end());
+            if (!at_sentinel() || !refill()) {
+                return start;
+            }
+        }
+    }
+
+public:
+    Lexer(InputSource& input, SymbolTable& symbols)
+        : input(&input), cur(input.data()), symbols(symbols) {}
+
+    SymbolTable& get_symbols() const { return symbols; }
+    const InputSource& get_input() const { return *input; }
+
+    // only valid until the next refill, so copy it if it has to live longer
+    std::string_view span_text(SourceSpan span) const {
+        return std::string_view(input->data() + span.offset, span.length);
+    }
+
+    Token next() {
+        Token tok;
+        while (true) {
+            scan_class<cc_space>();
+            if (!at_sentinel()) {
+                break;
+            }
+            if (!refill()) {
+                tok.kind = tok_eof;
+                tok.span.offset = cur - input->data();
+                return tok;
+            }
+        }
+
+        if (char_is(*cur, cc_alpha)) {
+            size_t start = scan_class<cc_alnum>();
+            tok.span.offset = start;
+            tok.span.length = (cur - input->data()) - start;
+
+            tok.sym = symbols.intern(span_text(tok.span));
+            if (tok.sym == sym_def) {
+                tok.kind = tok_def;
+            } else if (tok.sym == sym_extern) {
+                tok.kind = tok_extern;
+            } else {
+                tok.kind = tok_ident;
+            }
+            return tok;
+        }
+
+        if (char_is(*cur, cc_number)) {
+            size_t start = scan_class<cc_number>();
+            const char* begin = input->data() + start;
+            tok.span.offset = start;
+            tok.span.length = cur - begin;
+            if (!parse_number_literal(begin, cur, &tok.num)) {
+                tok.kind = tok_error;
+                return tok;
+            }
+            tok.kind = tok_num;
+            return tok;
+        }
+
+        // TODO: handle comments
+
+        tok.span.offset = cur - input->data();
+        tok.span.length = 1;
+        tok.kind = static_cast<unsigned char>(*cur++);
+        return tok;
+    }
+};
+
+// precedence of each binary operator, indexed by the operator char. -1 for
+// chars that aren't operators. higher binds tighter.
+static std::array<int, 256> BinopPrecedence = [] {
+    std::array<int, 256> table;
+    table.fill(-1);
+    table['<'] = 10;
+    table['+'] = 20;
+    table['-'] = 20;
+    table['*'] = 40;
+    table['/'] = 40;
+    return table;
+}();
+
+// adds an operator or changes the precedence of an existing one. a negative
+// precedence removes it.
+static void set_binop_precedence(char op, int prec) {
+    BinopPrecedence[static_cast<unsigned char>(op)] = prec < 0 ? -1 : prec;
+}
+
+static int get_binop_precedence(int tok) {
+    if (tok < 0 || tok > 255) {
+        return -1;
+    }
+    return BinopPrecedence[tok];
+}
+
+
+//////////////////
+/* TOKEN STREAM */
+//////////////////
+
+// all of src lexed up front into one array ending with its tok_eof. no
+// lexer is left to keep around afterwards, and walking the array is about
+// as cheap as getting at a token can be.
+static std::vector<Token> lex_all(InputSource& src, SymbolTable& symbols) {
+    std::vector<Token> tokens;
+    // most tokens take a few chars, so this mostly saves the regrowing
+    tokens.reserve(src.size() / 4 + 1);
+    Lexer lex(src, symbols);
+    while (true) {
+        tokens.push_back(PhaseScope::lex_token([&] { return lex.next(); }));
+        if (tokens.back().kind == tok_eof) {
+            return tokens;
+        }
+    }
+}
+
+// bounded queue between exactly one producing and one consuming thread.
+// each side writes only its own index and reads the other's, so neither
+// takes a lock. a side finding the queue full or empty yields and looks
+// again.
+template <typename T, size_t N>
+class SpscQueue {
+    static_assert((N & (N - 1)) == 0, "the size must be a power of two");
+
+    T slots[N];
+    // next slot to pop, written by the consumer
+    alignas(64) std::atomic<size_t> head{0};
+    // next slot to push, written by the producer
+    alignas(64) std::atomic<size_t> tail{0};
+
+public:
+    // blocks until all n items are in
+    void push(const T* items, size_t n) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        while (n > 0) {
+            size_t room = N - (t - head.load(std::memory_order_acquire));
+            if (room == 0) {
+                std::this_thread::yield();
+                continue;
+            }
+            size_t k = std::min(room, n);
+            for (size_t i = 0; i < k; i++) {
+                slots[(t + i) & (N - 1)] = items[i];
+            }
+            t += k;
+            items += k;
+            n -= k;
+            tail.store(t, std::memory_order_release);
+        }
+    }
+
+    // blocks until there is something to pop, then pops up to n items
+    // into out. returns how many.
+    size_t pop(T* out, size_t n) {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t t;
+        while ((t = tail.load(std::memory_order_acquire)) == h) {
+            std::this_thread::yield();
+        }
+        size_t k = std::min(t - h, n);
+        for (size_t i = 0; i < k; i++) {
+            out[i] = slots[(h + i) & (N - 1)];
+        }
+        head.store(h + k, std::memory_order_release);
+        return k;
+    }
+};
+
+// the tokens a Parser reads, with up to lookahead tokens of lookahead.
+// they come from one of
+//      a Lexer     lexed one at a time as they are asked for, so the repl
+//                  never waits on input it doesn't need yet
+//      an array    from lex_all()
+//      a queue     filled by lex_into_queue() on another thread
+// after a tok_eof the stream keeps returning it.
+class TokenStream {
+public:
+    static constexpr size_t lookahead = 16;
+    // tokens moved through the queue at a time
+    static constexpr size_t batch_size = 256;
+    using Queue = SpscQueue<Token, 4096>;
+
+private:
+    const InputSource& src;
+    Lexer* lex = nullptr;
+    const Token* array = nullptr;
+    Queue* queue = nullptr;
+
+    // tokens peeked at but not taken yet, ring[(head + i) % lookahead] for
+    // i < count
+    std::array<Token, lookahead> ring;
+    uint32_t head = 0;
+    uint32_t count = 0;
+
+    // popped off the queue but not read yet
+    std::array<Token, batch_size> batch;
+    uint32_t batch_pos = 0;
+    uint32_t batch_len = 0;
+
+    Token pull() {
+        if (lex) {
+            return PhaseScope::lex_token([&] { return lex->next(); });
+        }
+        if (array) {
+            Token tok = *array;
+            if (tok.kind != tok_eof) {
+                ++array;
+            }
+            return tok;
+        }
+        if (batch_pos == batch_len) {
+            batch_len = queue->pop(batch.data(), batch.size());
+            batch_pos = 0;
+        }
+        Token tok = batch[batch_pos];
+        if (tok.kind != tok_eof) {
+            ++batch_pos;
+        }
+        return tok;
+    }
+
+public:
+    explicit TokenStream(Lexer& lex) : src(lex.get_input()), lex(&lex) {}
+
+    // tokens of src from lex_all(). they have to outlive the stream.
+    TokenStream(const InputSource& src, const std::vector<Token>& tokens)
+        : src(src), array(tokens.data()) {}
+
+    // tokens of src coming in through queue. the stream has to be read to
+    // its tok_eof, or the producer may block for good on a full queue.
+    TokenStream(const InputSource& src, Queue& queue)
+        : src(src), queue(&queue) {}
+
+    Token next() {
+        if (count > 0) {
+            Token tok = ring[head];
+            head = (head + 1) % lookahead;
+            --count;
+            return tok;
+        }
+        return pull();
+    }
+
+    // the token k places after the one next() returns next, so peek(0) is
+    // that one. k has to be less than lookahead.
+    const Token& peek(size_t k = 0) {
+        while (count <= k) {
+            ring[(head + count) % lookahead] = pull();
+            ++count;
+        }
+        return ring[(head + k) % lookahead];
+    }
+
+    // the same as Lexer::span_text()
+    std::string_view span_text(SourceSpan span) const {
+        return std::string_view(src.data() + span.offset, span.length);
+    }
+
+    const InputSource& source() const { return src; }
+};
+
+// the producing side of a TokenStream on a queue. lexes all of src into
+// queue, the tok_eof included, a batch at a time so each thread touches
+// the other's index once per batch rather than once per token. src must
+// not be one that refills, the consumer reads spans out of it meanwhile.
+static void lex_into_queue(InputSource& src, SymbolTable& symbols,
+                           TokenStream::Queue& queue) {
+    Lexer lex(src, symbols);
+    std::array<Token, TokenStream::batch_size> batch;
+    size_t n = 0;
+    while (true) {
+        batch[n] = PhaseScope::lex_token([&] { return lex.next(); });
+        bool eof = batch[n++].kind == tok_eof;
+        if (eof || n == batch.size()) {
+            queue.push(batch.data(), n);
+            n = 0;
+        }
+        if (eof) {
+            return;
+        }
+    }
+}
+
+// the ways of getting from an InputSource to a TokenStream
+enum class TokenFeed : uint8_t {
+    Pull,
+    Array,
+    Queue,
+};
+
+// what the parallel driver uses, see --tokens
+static TokenFeed DriverTokenFeed = TokenFeed::Pull;
+
+// calls use(TokenStream&) on the tokens of src, fed to it as asked. use
+// has to read them to the tok_eof. with a queue the lexer gets a thread of
+// its own, so lexing and parsing overlap, and only that thread touches
+// symbols until use returns.
+template <typename F>
+static void with_tokens(InputSource& src, SymbolTable& symbols,
+                        TokenFeed feed, F use) {
+    switch (feed) {
+        case TokenFeed::Pull: {
+            Lexer lex(src, symbols);
+            TokenStream toks(lex);
+            use(toks);
+            return;
+        }
+        case TokenFeed::Array: {
+            std::vector<Token> tokens = lex_all(src, symbols);
+            TokenStream toks(src, tokens);
+            use(toks);
+            return;
+        }
+        case TokenFeed::Queue: {
+            auto queue = std::make_unique<TokenStream::Queue>();
+            std::thread lexer([&] {
+                ThreadTraceScope trace;
+                lex_into_queue(src, symbols, *queue);
+            });
+            TokenStream toks(src, *queue);
+            use(toks);
+            lexer.join();
+            return;
+        }
+    }
+}
+
+
+///////////////
+/* AST ARENA */
+///////////////
+
+// bump allocator that owns every node of one top level item. nodes are
+// never destroyed one by one, reset() drops all of them at once and keeps
+// the blocks around for the next item. anything allocated here must be
+// trivially destructible.
+class AstContext {
+    static constexpr size_t block_size = 64 * 1024;
+
+    std::vector<std::unique_ptr<char[]>> blocks;
+    size_t block_index = 0;
+    char* cur = nullptr;
+    char* end = nullptr;
+
+    // allocations bigger than a block get their own and are freed on reset
+    std::vector<std::unique_ptr<char[]>> large;
+    size_t large_bytes = 0;
+
+    void* allocate_slow(size_t size, size_t align) {
+        if (size + align > block_size) {
+            large.emplace_back(new char[size + align]);
+            large_bytes += size + align;
+            uintptr_t p = reinterpret_cast<uintptr_t>(large.back().get());
+            return reinterpret_cast<void*>((p + align - 1) & ~(align - 1));
+        }
+
+        if (block_index + 1 < blocks.size()) {
+            ++block_index;
+        } else {
+            blocks.emplace_back(new char[block_size]);
+            block_index = blocks.size() - 1;
+        }
+        cur = blocks[block_index].get();
+        end = cur + block_size;
+        return allocate(size, align);
+    }
+
+public:
+    AstContext() = default;
+    AstContext(AstContext&&) = default;
+    AstContext& operator=(AstContext&&) = default;
+
+    void* allocate(size_t size, size_t align) {
+        uintptr_t p = reinterpret_cast<uintptr_t>(cur);
+        uintptr_t aligned = (p + align - 1) & ~(align - 1);
+        if (cur == nullptr || aligned + size > reinterpret_cast<uintptr_t>(end)) {
+            return allocate_slow(size, align);
+        }
+        cur = reinterpret_cast<char*>(aligned + size);
+        return reinterpret_cast<void*>(aligned);
+    }
+
+    template <typename T, typename... Args>
+    T* make(Args&&... args) {
+        static_assert(std::is_trivially_destructible_v<T>,
+                      "arena nodes are never destroyed");
+        return new (allocate(sizeof(T), alignof(T)))
+                T(std::forward<Args>(args)...);
+    }
+
+    template <typename T>
+    T* copy_array(const T* src, size_t n) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        if (n == 0) {
+            return nullptr;
+        }
+        T* dst = static_cast<T*>(allocate(sizeof(T) * n, alignof(T)));
+        memcpy(dst, src, sizeof(T) * n);
+        return dst;
+    }
+
+    // everything allocated after a mark can be dropped again, e.g. the
+    // nodes of an item that failed to parse
+    struct Mark {
+        size_t block_index;
+        char* cur;
+        char* end;
+        size_t large;
+        size_t large_bytes;
+    };
+
+    Mark mark() const {
+        return Mark{block_index, cur, end, large.size(), large_bytes};
+    }
+
+    void rollback(const Mark& m) {
+        large.resize(m.large);
+        large_bytes = m.large_bytes;
+        block_index = m.block_index;
+        cur = m.cur;
+        end = m.end;
+    }
+
+    // bytes handed out since the last reset, padding included
+    size_t bytes_used() const {
+        size_t used = large_bytes;
+        if (cur) {
+            used += block_index * block_size
+                    + (cur - blocks[block_index].get());
+        }
+        return used;
+    }
+
+    void reset() {
+        stats_arena_size(bytes_used());
+        large.clear();
+        large_bytes = 0;
+        block_index = 0;
+        if (blocks.empty()) {
+            cur = end = nullptr;
+        } else {
+            cur = blocks[0].get();
+            end = cur + block_size;
+        }
+    }
+};
+
+// fixed size array living in an AstContext
+template <typename T>
+class ArenaArray {
+    T* ptr = nullptr;
+    uint32_t len = 0;
+
+public:
+    ArenaArray() = default;
+    ArenaArray(T* ptr, uint32_t len) : ptr(ptr), len(len) {}
+
+    T* begin() const { return ptr; }
+    T* end() const { return ptr + len; }
+    uint32_t size() const { return len; }
+    T& operator[](uint32_t i) const { return ptr[i]; }
+};
+
+
+/////////
+/* AST */
+/////////
+
+enum class ExprKind : uint8_t {
+    Num,
+    Var,
+    Binary,
+    Call,
+    Function,
+};
+
+class Expr {
+    ExprKind kind;
+
+protected:
+    Expr(ExprKind kind) : kind(kind) {}
+
+public:
+    ExprKind get_kind() const { return kind; }
+};
+
+class NumExpr : public Expr {
+    double val;
+
+public:
+    NumExpr(double val) : Expr(ExprKind::Num), val(val) {}
+
+    double get_val() const { return val; }
+};
+
+class VarExpr : public Expr {
+    SymbolId name;
+
+public:
+    VarExpr(SymbolId name) : Expr(ExprKind::Var), name(name) {}
+
+    SymbolId get_name() const { return name; }
+    void set_name(SymbolId id) { name = id; }
+};
+
+class BinaryExpr : public Expr {
+    char op;
+    Expr *lhs, *rhs;
+
+public:
+    BinaryExpr(char op, Expr* lhs, Expr* rhs)
+        : Expr(ExprKind::Binary), op(op), lhs(lhs), rhs(rhs) {}
+
+    char get_op() const { return op; }
+    Expr* get_lhs() const { return lhs; }
+    Expr* get_rhs() const { return rhs; }
+};
+
+class CallExpr : public Expr {
+    SymbolId callee;
+    ArenaArray<Expr*> args;
+
+public:
+    CallExpr(SymbolId callee, ArenaArray<Expr*> args)
+        : Expr(ExprKind::Call), callee(callee), args(args) {}
+
+    SymbolId get_callee() const { return callee; }
+    void set_callee(SymbolId id) { callee = id; }
+    const ArenaArray<Expr*>& get_args() const { return args; }
+};
+
+
+class FuncPrototype {
+    SymbolId name;
+    ArenaArray<Expr*> args;
+
+public:
+    FuncPrototype(SymbolId name, ArenaArray<Expr*> args)
+        : name(name), args(args) {}
+
+    SymbolId get_name() const { return name; }
+    void set_name(SymbolId id) { name = id; }
+    // all VarExprs
+    const ArenaArray<Expr*>& get_args() const { return args; }
+};
+
+class FunctionExpr : public Expr {
+    FuncPrototype* proto;
+    Expr* body;
+
+public:
+    FunctionExpr(FuncPrototype* proto, Expr* body)
+        : Expr(ExprKind::Function), proto(proto), body(body) {}
+
+    FuncPrototype* get_proto() const { return proto; }
+    Expr* get_body() const { return body; }
+};
+
+// rewrites every symbol in the tree through map, for moving an AST over to
+// another symbol table. uses a worklist since trees from the explicit stack
+// parser can be far too deep to recurse over.
+static void remap_symbols(Expr* root, const std::vector<SymbolId>& map,
+                          std::vector<Expr*>& work) {
+    work.clear();
+    work.push_back(root);
+    while (!work.empty()) {
+        Expr* e = work.back();
+        work.pop_back();
+        switch (e->get_kind()) {
+            case ExprKind::Num:
+                break;
+            case ExprKind::Var: {
+                auto var = static_cast<VarExpr*>(e);
+                var->set_name(map[var->get_name()]);
+                break;
+            }
+            case ExprKind::Binary: {
+                auto bin = static_cast<BinaryExpr*>(e);
+                work.push_back(bin->get_lhs());
+                work.push_back(bin->get_rhs());
+                break;
+            }
+            case ExprKind::Call: {
+                auto call = static_cast<CallExpr*>(e);
+                call->set_callee(map[call->get_callee()]);
+                for (Expr* arg : call->get_args()) {
+                    work.push_back(arg);
+                }
+                break;
+            }
+            case ExprKind::Function: {
+                auto fn = static_cast<FunctionExpr*>(e);
+                FuncPrototype* proto = fn->get_proto();
+                proto->set_name(map[proto->get_name()]);
+                for (Expr* arg : proto->get_args()) {
+                    work.push_back(arg);
+                }
+                work.push_back(fn->get_body());
+                break;
+            }
+        }
+    }
+}
+
+//////////////
+/* FLAT AST */
+//////////////
+
+// alternative to the Expr tree: expressions live in parallel arrays and
+// refer to their operands by index. children are always appended before
+// their parent, so walking the ids in order visits every operand before
+// the node using it, without recursion or virtual calls.
+
+struct ExprId {
+    static constexpr uint32_t invalid = UINT32_MAX;
+    uint32_t index = invalid;
+
+    explicit operator bool() const { return index != invalid; }
+};
+
+enum class FlatKind : uint8_t {
+    Num,
+    Var,
+    Binary,
+    Call,
+};
+
+// the arrays a FlatExprPool reads, which either belong to the pool or are
+// those of an image mapped from an --ast-cache file (see AST IMAGE)
+struct FlatArrays {
+    const FlatKind* kinds = nullptr;
+    const char* ops = nullptr;
+    const uint32_t* xs = nullptr;
+    const uint32_t* ys = nullptr;
+    const double* literals = nullptr;
+    const uint32_t* call_args = nullptr;
+    uint32_t size = 0;
+};
+
+class FlatExprPool {
+    // per node. what x and y hold depends on the kind:
+    //      Num     x = index into literals
+    //      Var     x = symbol
+    //      Binary  x = lhs, y = rhs
+    //      Call    x = callee symbol, y = index into call_args of the
+    //              argument count, followed by the argument ids
+    std::vector<FlatKind> kinds;
+    std::vector<char> ops;
+    std::vector<uint32_t> xs;
+    std::vector<uint32_t> ys;
+
+    std::vector<double> literals;
+    std::vector<uint32_t> call_args;
+
+    // what the accessors read. points into the vectors above, kept up to
+    // date as they grow, unless the pool was made by mapped()
+    FlatArrays at;
+    bool is_mapped = false;
+
+    // when set, the symbols of Var and Call nodes are indices into this.
+    // lets a pool parsed against one symbol table be read against another
+    // without touching its nodes.
+    const SymbolId* symbol_map = nullptr;
+
+    void sync() {
+        at = FlatArrays{kinds.data(), ops.data(), xs.data(), ys.data(),
+                        literals.data(), call_args.data(),
+                        static_cast<uint32_t>(kinds.size())};
+    }
+
+    ExprId push(FlatKind kind, char op, uint32_t x, uint32_t y) {
+        ExprId id{static_cast<uint32_t>(kinds.size())};
+        kinds.push_back(kind);
+        ops.push_back(op);
+        xs.push_back(x);
+        ys.push_back(y);
+        sync();
+        return id;
+    }
+
+public:
+    FlatExprPool() = default;
+    FlatExprPool(const FlatExprPool& other) { *this = other; }
+    // moving a vector keeps its buffer, so at stays valid
+    FlatExprPool(FlatExprPool&&) = default;
+    FlatExprPool& operator=(FlatExprPool&&) = default;
+
+    FlatExprPool& operator=(const FlatExprPool& other) {
+        kinds = other.kinds;
+        ops = other.ops;
+        xs = other.xs;
+        ys = other.ys;
+        literals = other.literals;
+        call_args = other.call_args;
+        at = other.at;
+        is_mapped = other.is_mapped;
+        symbol_map = other.symbol_map;
+        if (!is_mapped) {
+            sync();
+        }
+        return *this;
+    }
+
+    // a read only pool over arrays that outlive it. nothing can be added.
+    static FlatExprPool mapped(const FlatArrays& arrays) {
+        FlatExprPool pool;
+        pool.at = arrays;
+        pool.is_mapped = true;
+        return pool;
+    }
+
+    ExprId num(double val) {
+        literals.push_back(val);
+        return push(FlatKind::Num, 0, literals.size() - 1, 0);
+    }
+
+    ExprId var(SymbolId name) {
+        return push(FlatKind::Var, 0, name, 0);
+    }
+
+    ExprId binary(char op, ExprId lhs, ExprId rhs) {
+        return push(FlatKind::Binary, op, lhs.index, rhs.index);
+    }
+
+    ExprId call(SymbolId callee, const ExprId* args, uint32_t n) {
+        uint32_t at = call_args.size();
+        call_args.push_back(n);
+        for (uint32_t i = 0; i < n; i++) {
+            call_args.push_back(args[i].index);
+        }
+        return push(FlatKind::Call, 0, callee, at);
+    }
+
+    uint32_t size() const { return at.size; }
+
+    FlatKind kind(ExprId id) const { return at.kinds[id.index]; }
+    char op(ExprId id) const { return at.ops[id.index]; }
+    double literal(ExprId id) const { return at.literals[at.xs[id.index]]; }
+    SymbolId symbol(ExprId id) const {
+        uint32_t x = at.xs[id.index];
+        return symbol_map ? symbol_map[x] : x;
+    }
+    ExprId lhs(ExprId id) const { return ExprId{at.xs[id.index]}; }
+    ExprId rhs(ExprId id) const { return ExprId{at.ys[id.index]}; }
+
+    uint32_t arg_count(ExprId id) const {
+        return at.call_args[at.ys[id.index]];
+    }
+    ExprId arg(ExprId id, uint32_t i) const {
+        return ExprId{at.call_args[at.ys[id.index] + 1 + i]};
+    }
+
+    void set_symbol_map(const SymbolId* map) { symbol_map = map; }
+
+    // what is added after a mark can be dropped again
+    struct Mark {
+        uint32_t nodes;
+        uint32_t literals;
+        uint32_t call_args;
+    };
+
+    Mark mark() const {
+        return Mark{static_cast<uint32_t>(kinds.size()),
+                    static_cast<uint32_t>(literals.size()),
+                    static_cast<uint32_t>(call_args.size())};
+    }
+
+    void rollback(const Mark& m) {
+        kinds.resize(m.nodes);
+        ops.resize(m.nodes);
+        xs.resize(m.nodes);
+        ys.resize(m.nodes);
+        literals.resize(m.literals);
+        call_args.resize(m.call_args);
+        sync();
+    }
+
+    // removes the literal id if nothing has been added after it
+    bool pop_literal(ExprId id) {
+        if (is_mapped || id.index + 1 != kinds.size()
+                || kinds.back() != FlatKind::Num
+                || xs.back() + 1 != literals.size()) {
+            return false;
+        }
+        literals.pop_back();
+        kinds.pop_back();
+        ops.pop_back();
+        xs.pop_back();
+        ys.pop_back();
+        sync();
+        return true;
+    }
+
+    void clear() {
+        kinds.clear();
+        ops.clear();
+        xs.clear();
+        ys.clear();
+        literals.clear();
+        call_args.clear();
+        sync();
+    }
+};
+
+// a function whose body is in a FlatExprPool. the prototype is still an
+// arena node since it has no expressions to flatten. several bodies can
+// share a pool, each being the nodes first to body. some of those may be
+// left unused by a FoldingBuilder, but none belong to another body.
+struct FlatFunction {
+    FuncPrototype* proto = nullptr;
+    const FlatExprPool* pool = nullptr;
+    ExprId body;
+    ExprId first;
+
+    explicit operator bool() const { return proto != nullptr; }
+};
+
+
+//////////////////
+/* AST BUILDERS */
+//////////////////
+
+// the expression parser is written against a builder so the same code can
+// produce either representation. a builder provides
+//      Ref     handle to a built expression, false when default constructed
+//      Func    handle to a built function, false when default constructed
+//      num, var, binary    build a node
+//      begin_args, push_arg, drop_args, call
+//                          collect the arguments of a call, nested calls
+//                          push on top of their parent's arguments
+//      begin_function      called before each body is parsed
+//      function            wrap a prototype and body
+//      literal             the value of a Ref if it is a number
+//      discard             drop a number nothing refers to any more, if
+//                          the representation allows it. true if it did.
+//      nodes               number of nodes built and not discarded
+//      mark, rollback      drop everything built after a Mark, e.g. an
+//                          item that failed to parse
+//      reset               drop everything built
+
+class TreeBuilder {
+    AstContext& ctx;
+
+    // argument lists are collected here while they are parsed and copied
+    // into the arena once complete, so this stops allocating once it has
+    // grown to the deepest nesting seen
+    std::vector<Expr*> args;
+
+public:
+    using Ref = Expr*;
+    using Func = Expr*;
+
+    uint64_t nodes = 0;
+
+    TreeBuilder(AstContext& ctx) : ctx(ctx) {}
+
+    Ref num(double val) {
+        ++nodes;
+        return ctx.make<NumExpr>(val);
+    }
+    Ref var(SymbolId name) {
+        ++nodes;
+        return ctx.make<VarExpr>(name);
+    }
+    Ref binary(char op, Ref lhs, Ref rhs) {
+        ++nodes;
+        return ctx.make<BinaryExpr>(op, lhs, rhs);
+    }
+
+    size_t begin_args() { return args.size(); }
+    void push_arg(Ref arg) { args.push_back(arg); }
+    void drop_args(size_t mark) { args.resize(mark); }
+
+    ArenaArray<Expr*> pop_args(size_t mark) {
+        uint32_t n = args.size() - mark;
+        Expr** copied = ctx.copy_array(args.data() + mark, n);
+        args.resize(mark);
+        return ArenaArray<Expr*>(copied, n);
+    }
+
+    Ref call(SymbolId callee, size_t mark) {
+        ++nodes;
+        return ctx.make<CallExpr>(callee, pop_args(mark));
+    }
+
+    void begin_function() {}
+
+    Func function(FuncPrototype* proto, Ref body) {
+        ++nodes;
+        return ctx.make<FunctionExpr>(proto, body);
+    }
+
+    bool literal(Ref ref, double& val) const {
+        if (ref->get_kind() != ExprKind::Num) {
+            return false;
+        }
+        val = static_cast<NumExpr*>(ref)->get_val();
+        return true;
+    }
+
+    // it stays in the arena until the reset
+    bool discard(Ref) { return false; }
+
+    struct Mark {
+        AstContext::Mark ctx;
+        uint64_t nodes;
+    };
+
+    Mark mark() const { return Mark{ctx.mark(), nodes}; }
+
+    void rollback(const Mark& m) {
+        ctx.rollback(m.ctx);
+        nodes = m.nodes;
+    }
+
+    void reset() { ctx.reset(); }
+};
+
+class FlatBuilder {
+    FlatExprPool& pool;
+    std::vector<ExprId> args;
+    // where the body being parsed starts, whatever is left before it of
+    // items that failed to parse
+    ExprId first{0};
+
+public:
+    using Ref = ExprId;
+    using Func = FlatFunction;
+
+    uint64_t nodes = 0;
+
+    FlatBuilder(FlatExprPool& pool) : pool(pool) {}
+
+    Ref num(double val) {
+        ++nodes;
+        return pool.num(val);
+    }
+    Ref var(SymbolId name) {
+        ++nodes;
+        return pool.var(name);
+    }
+    Ref binary(char op, Ref lhs, Ref rhs) {
+        ++nodes;
+        return pool.binary(op, lhs, rhs);
+    }
+
+    size_t begin_args() { return args.size(); }
+    void push_arg(Ref arg) { args.push_back(arg); }
+    void drop_args(size_t mark) { args.resize(mark); }
+
+    Ref call(SymbolId callee, size_t mark) {
+        ++nodes;
+        Ref id = pool.call(callee, args.data() + mark, args.size() - mark);
+        args.resize(mark);
+        return id;
+    }
+
+    void begin_function() { first = ExprId{pool.size()}; }
+
+    Func function(FuncPrototype* proto, Ref body) {
+        ++nodes;
+        return FlatFunction{proto, &pool, body, first};
+    }
+
+    bool literal(Ref ref, double& val) const {
+        if (pool.kind(ref) != FlatKind::Num) {
+            return false;
+        }
+        val = pool.literal(ref);
+        return true;
+    }
+
+    // only the newest node can go, the others stay unused in the pool
+    bool discard(Ref ref) {
+        if (!pool.pop_literal(ref)) {
+            return false;
+        }
+        --nodes;
+        return true;
+    }
+
+    struct Mark {
+        FlatExprPool::Mark pool;
+        uint64_t nodes;
+    };
+
+    Mark mark() const { return Mark{pool.mark(), nodes}; }
+
+    void rollback(const Mark& m) {
+        pool.rollback(m.pool);
+        nodes = m.nodes;
+    }
+
+    void reset() { pool.clear(); }
+};
+
+// set with --fold[=fast-math], parses with a FoldingBuilder
+static bool FoldConstants = false;
+static bool FoldFastMath = false;
+
+// B, with expressions folded as they are built: + - * of two numbers
+// become one number, and x*1, 1*x and x-0 become x. all of those give
+// bit for bit what running them would. x+0 and 0+x become x only with
+// FoldFastMath, since -0 + 0 is +0. divisions and comparisons are left
+// alone.
+template <typename B>
+class FoldingBuilder : public B {
+    // whether x op k, or k op x when k_left, is always x
+    static bool is_identity(char op, double k, bool k_left) {
+        switch (op) {
+            case '*':
+                return k == 1;
+            case '-':
+                return !k_left && k == 0 && !std::signbit(k);
+            case '+':
+                return FoldFastMath && k == 0;
+            default:
+                return false;
+        }
+    }
+
+public:
+    using typename B::Ref;
+    using B::B;
+
+    Ref binary(char op, Ref lhs, Ref rhs) {
+        double a, b;
+        bool lhs_num = this->literal(lhs, a);
+        bool rhs_num = this->literal(rhs, b);
+
+        if (lhs_num && rhs_num && (op == '+' || op == '-' || op == '*')) {
+            double v = op == '+' ? a + b : op == '-' ? a - b : a * b;
+            // rhs first, it was built last
+            this->discard(rhs);
+            this->discard(lhs);
+            return this->num(v);
+        }
+        if (rhs_num && is_identity(op, b, false)) {
+            this->discard(rhs);
+            return lhs;
+        }
+        if (lhs_num && is_identity(op, a, true)) {
+            this->discard(lhs);
+            return rhs;
+        }
+        return B::binary(op, lhs, rhs);
+    }
+};
+
+// set with --hash-cons, parses with a HashConsBuilder
+static bool HashConsing = false;
+
+// B, with structurally equal expressions within a function built once:
+// numbers by their bits, variables by name and binary expressions by
+// operator and operands, so equal operands are already the same node.
+// calls are always built anew, the callee may reach an extern with side
+// effects such as putchard. the flat codegen and interpreter handle each
+// node once, so a shared node is emitted and evaluated once per function.
+// nodes counts what is built, not the expressions sharing it.
+template <typename B>
+class HashConsBuilder : public B {
+public:
+    using typename B::Ref;
+
+private:
+    // open addressing, and begin_function() moves to the next generation
+    // rather than clearing, so a function costs nothing when it starts.
+    // kind is a FlatKind, which HashConsBuilder uses for either builder.
+    struct Slot {
+        uint64_t a = 0;
+        uint64_t b = 0;
+        uint32_t generation = 0;
+        FlatKind kind = FlatKind::Num;
+        char op = 0;
+        Ref ref;
+    };
+
+    std::vector<Slot> slots = std::vector<Slot>(1024);
+    uint32_t generation = 1;
+    size_t used = 0;
+
+    static uint64_t key(Expr* e) { return reinterpret_cast<uintptr_t>(e); }
+    static uint64_t key(ExprId id) { return id.index; }
+
+    size_t home(FlatKind kind, char op, uint64_t a, uint64_t b) const {
+        uint64_t h = (a * 0x9e3779b97f4a7c15ull) ^ (b + 0x632be59bd9b4e019ull)
+                ^ (uint64_t(kind) << 8 | uint8_t(op));
+        h ^= h >> 29;
+        h *= 0xbf58476d1ce4e5b9ull;
+        h ^= h >> 32;
+        return h & (slots.size() - 1);
+    }
+
+    Slot& find(FlatKind kind, char op, uint64_t a, uint64_t b) {
+        size_t i = home(kind, op, a, b);
+        while (true) {
+            Slot& slot = slots[i];
+            if (slot.generation != generation
+                    || (slot.kind == kind && slot.op == op && slot.a == a
+                        && slot.b == b)) {
+                return slot;
+            }
+            i = (i + 1) & (slots.size() - 1);
+        }
+    }
+
+    void grow() {
+        std::vector<Slot> old(slots.size() * 2);
+        old.swap(slots);
+        for (const Slot& slot : old) {
+            if (slot.generation == generation) {
+                find(slot.kind, slot.op, slot.a, slot.b) = slot;
+            }
+        }
+    }
+
+    // the node for the key, built by make if there is none yet
+    template <typename F>
+    Ref intern(FlatKind kind, char op, uint64_t a, uint64_t b, F make) {
+        Slot& slot = find(kind, op, a, b);
+        if (slot.generation == generation) {
+            return slot.ref;
+        }
+        Ref ref = make();
+        if (ref) {
+            slot = Slot{a, b, generation, kind, op, ref};
+            if (++used * 2 > slots.size()) {
+                grow();
+            }
+        }
+        return ref;
+    }
+
+public:
+    using B::B;
+
+    Ref num(double val) {
+        uint64_t bits;
+        memcpy(&bits, &val, sizeof(bits));
+        return intern(FlatKind::Num, 0, bits, 0,
+                      [&] { return B::num(val); });
+    }
+
+    Ref var(SymbolId name) {
+        return intern(FlatKind::Var, 0, name, 0,
+                      [&] { return B::var(name); });
+    }
+
+    Ref binary(char op, Ref lhs, Ref rhs) {
+        return intern(FlatKind::Binary, op, key(lhs), key(rhs),
+                      [&] { return B::binary(op, lhs, rhs); });
+    }
+
+    // a shared node may still be referred to, so nothing is dropped
+    bool discard(Ref) { return false; }
+
+    void begin_function() {
+        B::begin_function();
+        used = 0;
+        if (++generation == 0) {
+            std::fill(slots.begin(), slots.end(), Slot());
+            generation = 1;
+        }
+    }
+
+    // the table may have nodes that are gone now
+    void rollback(const typename B::Mark& m) {
+        B::rollback(m);
+        begin_function();
+    }
+
+    void reset() {
+        B::reset();
+        begin_function();
+    }
+};
+
+template <typename T>
+struct BuilderTag {
+    using type = T;
+};
+
+// calls use with a BuilderTag of B, wrapped as --fold and --hash-cons ask.
+// folding goes on the outside so the numbers it makes are shared too.
+template <typename B, typename F>
+static void with_builder(F use) {
+    if (FoldConstants && HashConsing) {
+        use(BuilderTag<FoldingBuilder<HashConsBuilder<B>>>());
+    } else if (FoldConstants) {
+        use(BuilderTag<FoldingBuilder<B>>());
+    } else if (HashConsing) {
+        use(BuilderTag<HashConsBuilder<B>>());
+    } else {
+        use(BuilderTag<B>());
+    }
+}
+
+
+/////////////////
+/* DIAGNOSTICS */
+/////////////////
+
+// parse errors are kept with the span they are about rather than reported
+// as they are found, and handed to a DiagnosticEngine in one go. the line
+// and column are only worked out then. the messages share one buffer,
+// which like the list keeps its capacity when flushed, so reporting again
+// doesn't allocate again.
+struct Diagnostic {
+    SourceSpan span;
+    Severity severity;
+    // of the message in Diagnostics::messages
+    uint32_t begin;
+    uint32_t length;
+};
+
+class Diagnostics {
+    std::vector<Diagnostic> pending;
+    std::string messages;
+
+    // how far flush() has counted lines, so diagnostics in input order
+    // scan the text once between them
+    size_t counted = 0;
+    uint32_t line = 1;
+    size_t line_start = 0;
+
+public:
+    void report(Severity sev, SourceSpan span, const char* fmt, ...)
+            __attribute__((format(printf, 4, 5))) {
+        va_list args;
+        va_start(args, fmt);
+        va_list copy;
+        va_copy(copy, args);
+        int n = std::max(vsnprintf(nullptr, 0, fmt, copy), 0);
+        va_end(copy);
+        size_t begin = messages.size();
+        messages.resize(begin + n + 1);
+        vsnprintf(&messages[begin], n + 1, fmt, args);
+        va_end(args);
+        messages.resize(begin + n);
+        pending.push_back(Diagnostic{span, sev, static_cast<uint32_t>(begin),
+                                     static_cast<uint32_t>(n)});
+    }
+
+    bool empty() const { return pending.empty(); }
+    size_t size() const { return pending.size(); }
+
+    // moves those of other after these
+    void append(Diagnostics&& other) {
+        uint32_t base = messages.size();
+        for (Diagnostic d : other.pending) {
+            d.begin += base;
+            pending.push_back(d);
+        }
+        messages += other.messages;
+        other.pending.clear();
+        other.messages.clear();
+    }
+
+    // for spans into part of a text starting at offset, e.g. a chunk
+    void shift(uint32_t offset) {
+        for (Diagnostic& d : pending) {
+            d.span.offset += offset;
+        }
+    }
+
+    // reports them all to out as being in name, and drops them. the spans
+    // index into the size bytes of text.
+    void flush(const char* name, const char* text, size_t size,
+               DiagnosticEngine& out) {
+        for (const Diagnostic& d : pending) {
+            size_t offset = std::min<size_t>(d.span.offset, size);
+            if (offset < counted) {
+                counted = 0;
+                line = 1;
+                line_start = 0;
+            }
+            while (const char* nl = static_cast<const char*>(
+                    memchr(text + counted, '\n', offset - counted))) {
+                ++line;
+                counted = line_start = nl - text + 1;
+            }
+            counted = offset;
+
+            SourceLocation at{name, line,
+                              static_cast<uint32_t>(offset - line_start + 1)};
+            out.report(d.severity, &at, "%.*s", static_cast<int>(d.length),
+                       messages.data() + d.begin);
+        }
+        pending.clear();
+        messages.clear();
+    }
+};
+
+
+////////////
+/* PARSER */
+////////////
+
+// selects parse_expr_explicit_stack over the recursive parser
+static bool ExplicitStackParse = false;
+
+// reads the tokens of toks. expressions are built with B, see AST
+// BUILDERS. prototypes are always built as tree nodes in ctx. like the
+// Lexer all state is per instance.
+//
+// an item that fails to parse reports its first error to diags, drops the
+// nodes it built and leaves the parser on the token the error was found
+// at. recover() then skips to where the next item can start.
+template <typename B>
+class Parser {
+public:
+    using Ref = typename B::Ref;
+    using Func = typename B::Func;
+
+private:
+    TokenStream& toks;
+    B& b;
+    AstContext& ctx;
+    TreeBuilder protos;
+
+    Token tok;
+
+    Diagnostics diags;
+    // an error of the item being parsed has been reported
+    bool panicking = false;
+
+    struct Frame {
+        SymbolId callee;
+        size_t arg_mark;
+        size_t op_base;
+    };
+
+    // stacks of parse_expr_explicit_stack, kept so they stop allocating
+    // once grown
+    std::vector<Ref> operands;
+    std::vector<char> ops;
+    std::vector<Frame> frames;
+
+    // what t is, as before text after
+    struct Found {
+        const char* before;
+        std::string_view text;
+        const char* after;
+    };
+
+    Found describe(const Token& t) const {
+        switch (t.kind) {
+            case tok_eof:
+                return Found{"end of input", {}, ""};
+            case tok_def:
+                return Found{"'def'", {}, ""};
+            case tok_extern:
+                return Found{"'extern'", {}, ""};
+            case tok_ident:
+                return Found{"identifier ", toks.span_text(t.span), ""};
+            case tok_num:
+                return Found{"number ", toks.span_text(t.span), ""};
+            default:
+                return Found{"'", toks.span_text(t.span), "'"};
+        }
+    }
+
+    // only the first error of an item is reported, the others follow
+    // from it
+    void log_error(const char* str) {
+        if (panicking) {
+            return;
+        }
+        panicking = true;
+        std::string_view text = toks.span_text(tok.span);
+        if (tok.kind == tok_error) {
+            diags.report(Severity::Error, tok.span,
+                         "malformed number literal %.*s",
+                         static_cast<int>(text.size()), text.data());
+            return;
+        }
+        Found found = describe(tok);
+        diags.report(Severity::Error, tok.span, "%s, found %s%.*s%s", str,
+                     found.before, static_cast<int>(found.text.size()),
+                     found.text.data(), found.after);
+    }
+
+    template <typename R>
+    R log_error(const char* str) {
+        log_error(str);
+        return R();
+    }
+
+    Ref parse_ident() {
+        SymbolId name = tok.sym;
+        get_next_token();
+
+        // if the name is followed by parentheses then it is a function call
+        if (tok.kind != '(') {
+            return b.var(name);
+        }
+
+        size_t mark = b.begin_args();
+        get_next_token(); // eat '('
+
+        if (tok.kind != ')') {
+            while (true) {
+                if (auto arg = parse_expr()) {
+                    b.push_arg(arg);
+                } else {
+                    b.drop_args(mark);
+                    return log_error<Ref>("failed to parse argument");
+                }
+
+                if (tok.kind == ')') {
+                    break;
+                }
+                if (tok.kind != ',') {
+                    b.drop_args(mark);
+                    return log_error<Ref>(
+                            "expected ',' or ')' in argument list");
+                }
+
+                get_next_token();
+            }
+        }
+        get_next_token(); // eat the ')'
+
+        return b.call(name, mark);
+    }
+
+    Ref parse_number() {
+        auto result = b.num(tok.num);
+        get_next_token(); // eat the number
+        return result;
+    }
+
+    Ref parse_primary() {
+        switch (tok.kind) {
+            case tok_ident:
+                return parse_ident();
+            case tok_num:
+                return parse_number();
+            default:
+                return log_error<Ref>("expected an expression");
+        }
+    }
+
+    // of the form
+    //      ('+' primary)*
+    // consumes operators binding at least as tightly as min_prec. the
+    // recursion only goes one level deeper per increase in precedence, so
+    // its depth is bounded by the number of precedence levels, not the
+    // length of the chain.
+    Ref parse_binop_rhs(int min_prec, Ref lhs) {
+        while (true) {
+            int prec = get_binop_precedence(tok.kind);
+            if (prec < min_prec) {
+                return lhs;
+            }
+
+            int op = tok.kind;
+            get_next_token(); // eat the op (only if it is a valid op)
+
+            auto rhs = parse_primary();
+            if (!rhs) {
+                return log_error<Ref>(
+                        "could not parse right hand side of binary expression");
+            }
+
+            // if the next op binds tighter it takes rhs as its lhs. all ops
+            // are left associative so an op of the same precedence doesn't.
+            if (prec < get_binop_precedence(tok.kind)) {
+                rhs = parse_binop_rhs(prec + 1, rhs);
+                if (!rhs) {
+                    return Ref();
+                }
+            }
+
+            lhs = b.binary(op, lhs, rhs);
+        }
+    }
+
+    // parses the same grammar as the recursive functions above with
+    // explicit operand, operator and call stacks on the heap, so nesting
+    // depth is not limited by the native stack. operators are handled
+    // shunting-yard style, and each open call gets a frame remembering
+    // where its operators and operands start.
+    Ref parse_expr_explicit_stack() {
+        operands.clear();
+        ops.clear();
+        frames.clear();
+
+        // reports the same error the recursive parser would
+        auto fail = [&](const char* msg) {
+            log_error(msg);
+            if (!frames.empty()) {
+                b.drop_args(frames.front().arg_mark);
+            }
+            return Ref();
+        };
+
+        // combine operators above base that bind at least as tightly as prec
+        auto reduce = [&](size_t base, int prec) {
+            while (ops.size() > base
+                    && get_binop_precedence(ops.back()) >= prec) {
+                char op = ops.back();
+                ops.pop_back();
+                Ref rhs = operands.back();
+                operands.pop_back();
+                operands.back() = b.binary(op, operands.back(), rhs);
+            }
+        };
+
+        while (true) {
+            // expecting a primary
+            switch (tok.kind) {
+                case tok_num:
+                    operands.push_back(parse_number());
+                    break;
+
+                case tok_ident: {
+                    SymbolId name = tok.sym;
+                    get_next_token();
+                    if (tok.kind != '(') {
+                        operands.push_back(b.var(name));
+                        break;
+                    }
+
+                    get_next_token(); // eat '('
+                    if (tok.kind == ')') {
+                        get_next_token(); // eat the ')'
+                        operands.push_back(b.call(name, b.begin_args()));
+                        break;
+                    }
+
+                    frames.push_back(Frame{name, b.begin_args(), ops.size()});
+                    continue;
+                }
+
+                default:
+                    return fail("expected an expression");
+            }
+
+            // after a primary: either a binary op continues the expression
+            // or the expression of the innermost open call or the whole
+            // thing ends
+            while (true) {
+                size_t base = frames.empty() ? 0 : frames.back().op_base;
+
+                int prec = get_binop_precedence(tok.kind);
+                if (prec >= 0) {
+                    reduce(base, prec);
+                    ops.push_back(tok.kind);
+                    get_next_token(); // eat the op
+                    if (tok.kind != tok_ident && tok.kind != tok_num) {
+                        return fail("expected an expression");
+                    }
+                    break;
+                }
+
+                reduce(base, 0);
+                if (frames.empty()) {
+                    return operands.back();
+                }
+
+                if (tok.kind != ',' && tok.kind != ')') {
+                    return fail("expected ',' or ')' in argument list");
+                }
+
+                b.push_arg(operands.back());
+                operands.pop_back();
+
+                if (tok.kind == ',') {
+                    get_next_token(); // eat the ','
+                    break;
+                }
+
+                get_next_token(); // eat the ')'
+                Frame frame = frames.back();
+                frames.pop_back();
+                operands.push_back(b.call(frame.callee, frame.arg_mark));
+            }
+        }
+    }
+
+    FuncPrototype* parse_prototype() {
+        if (tok.kind != tok_ident) {
+            return log_error<FuncPrototype*>("expected function name");
+        }
+
+        SymbolId name = tok.sym;
+        get_next_token(); // eat name
+
+        if (tok.kind != '(') {
+            return log_error<FuncPrototype*>("expected (");
+        }
+
+        size_t mark = protos.begin_args();
+        get_next_token(); // eat '('
+
+        if (tok.kind != ')') {
+            while (true) {
+                if (tok.kind == tok_ident) {
+                    protos.push_arg(protos.var(tok.sym));
+                    get_next_token(); // eat the name
+                } else {
+                    protos.drop_args(mark);
+                    return log_error<FuncPrototype*>(
+                            "expected an argument name in the prototype");
+                }
+
+                if (tok.kind == ')') {
+                    break;
+                }
+                if (tok.kind != ',') {
+                    protos.drop_args(mark);
+                    return log_error<FuncPrototype*>(
+                            "expected ',' or ')' in argument list");
+                }
+
+                get_next_token();
+            }
+        }
+        get_next_token(); // eat the ')'
+
+        return ctx.make<FuncPrototype>(name, protos.pop_args(mark));
+    }
+
+public:
+    Parser(TokenStream& toks, B& b, AstContext& ctx)
+        : toks(toks), b(b), ctx(ctx), protos(ctx) {}
+
+    int current() const { return tok.kind; }
+
+    int get_next_token() {
+        tok = toks.next();
+        return tok.kind;
+    }
+
+    // counts the prototype arguments, which b never sees
+    uint64_t nodes() const { return b.nodes + protos.nodes; }
+
+    // drops everything parsed so far in one go
+    void reset_ast() {
+        b.reset();
+        ctx.reset();
+    }
+
+    Diagnostics& diagnostics() { return diags; }
+
+    // hands on what was reported so far, see Diagnostics::flush()
+    void flush_diagnostics(const char* name, DiagnosticEngine& out) {
+        const InputSource& src = toks.source();
+        diags.flush(name, src.data(), src.size(), out);
+    }
+
+    // after an item failed to parse, skips to the next ';', 'def' or
+    // 'extern', which is where main_loop() dispatches again
+    void recover() {
+        while (tok.kind != ';' && tok.kind != tok_def
+                && tok.kind != tok_extern && tok.kind != tok_eof) {
+            get_next_token();
+        }
+    }
+
+    Ref parse_expr() {
+        if (ExplicitStackParse) {
+            return parse_expr_explicit_stack();
+        }
+
+        auto lhs = parse_primary();
+        if (!lhs) {
+            return Ref();
+        }
+
+        return parse_binop_rhs(0, lhs);
+    }
+
+    // definition ::=
+    //      'def' proto expr
+    Func parse_definition() {
+        PhaseScope scope(Phase::Parse);
+        panicking = false;
+        auto proto_mark = protos.mark();
+        auto mark = b.mark();
+        get_next_token(); // eat the 'def'
+        auto proto = parse_prototype();
+        if (!proto) {
+            protos.rollback(proto_mark);
+            return Func();
+        }
+
+        b.begin_function();
+        auto body = parse_expr();
+        if (!body) {
+            log_error("expected function body");
+            b.rollback(mark);
+            protos.rollback(proto_mark);
+            return Func();
+        }
+        return b.function(proto, body);
+    }
+
+    Func parse_toplevel_expr() {
+        PhaseScope scope(Phase::Parse);
+        panicking = false;
+        auto mark = b.mark();
+        b.begin_function();
+        if (auto e = parse_expr()) {
+            auto proto = ctx.make<FuncPrototype>(sym_anon_expr,
+                                                 ArenaArray<Expr*>());
+            return b.function(proto, e);
+        }
+        b.rollback(mark);
+        return Func();
+    }
+
+    FuncPrototype* parse_extern() {
+        PhaseScope scope(Phase::Parse);
+        panicking = false;
+        auto proto_mark = protos.mark();
+        get_next_token(); // eat the 'extern'
+        auto proto = parse_prototype();
+        if (!proto) {
+            protos.rollback(proto_mark);
+        }
+        return proto;
+    }
+};
+
+
+////////////////
+/* CALL GRAPH */
+////////////////
+
+// which definitions call which functions, by SymbolId, kept up to date as
+// definitions come and go. nothing is ever inlined across definitions:
+// the jit compiles each function on its own and calls between them go
+// through stubs. so when a function is redefined its callers keep their
+// code as it is, and the graph is only needed to tell whether a change to
+// the number of arguments would break any of them.
+class CallGraph {
+    // without duplicates
+    std::vector<std::vector<SymbolId>> callees;
+    std::vector<std::vector<SymbolId>> callers;
+
+    static std::vector<SymbolId>& at(std::vector<std::vector<SymbolId>>& v,
+                                     SymbolId id) {
+        if (id >= v.size()) {
+            v.resize(id + 1);
+        }
+        return v[id];
+    }
+
+public:
+    // replaces what fn calls with calls, which may hold duplicates
+    void set_callees(SymbolId fn, std::vector<SymbolId>& calls) {
+        for (SymbolId callee : at(callees, fn)) {
+            auto& list = callers[callee];
+            list.erase(std::find(list.begin(), list.end(), fn));
+        }
+
+        std::sort(calls.begin(), calls.end());
+        calls.erase(std::unique(calls.begin(), calls.end()), calls.end());
+        for (SymbolId callee : calls) {
+            at(callers, callee).push_back(fn);
+        }
+        callees[fn] = calls;
+    }
+
+    // whether any definition other than fn itself calls fn
+    bool has_other_callers(SymbolId fn) const {
+        if (fn >= callers.size()) {
+            return false;
+        }
+        for (SymbolId caller : callers[fn]) {
+            if (caller != fn) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+
+/////////////
+/* PROFILE */
+/////////////
+
+// call counts for profile guided optimization. with
+// --profile-generate=<file> codegen has every definition count how often
+// it is called and how often it calls each of its callees, and the counts
+// are written to file once the program is done. --tiered counts what it
+// interprets as well. with --profile-use=<file> codegen gives definitions
+// their count from file as their entry count, which the inliner weighs its
+// call sites by, and marks the ones that were never called cold, so they
+// are optimized for size and placed away from the rest. there is no control
+// flow in the language, a body runs from start to end every time it is
+// called, so calls between definitions are the only edges to count.
+//
+// the file has a line per definition and one per pair of caller and callee
+//      function <name> <calls>
+//      edge <caller> <callee> <calls>
+class Profile {
+    // counts stay where they are once made, compiled code adds to them
+    // through their address. like clang's counters they are not atomic,
+    // calls made on several threads at once can go uncounted.
+    std::deque<uint64_t> counts;
+    std::unordered_map<std::string, uint64_t*> functions;
+    // by caller and callee, separated by a space
+    std::unordered_map<std::string, uint64_t*> edges;
+    // codegen runs on several threads with --serve
+    std::mutex mutex;
+
+    // of the function counts, once read
+    std::unique_ptr<llvm::ProfileSummary> summary;
+    uint64_t hot = UINT64_MAX;
+
+    static std::string edge_key(llvm::StringRef caller,
+                                llvm::StringRef callee) {
+        return (caller + " " + callee).str();
+    }
+
+    uint64_t* counter(std::unordered_map<std::string, uint64_t*>& by_key,
+                      std::string key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t*& c = by_key[std::move(key)];
+        if (!c) {
+            c = &counts.emplace_back(0);
+        }
+        return c;
+    }
+
+    static bool find(const std::unordered_map<std::string, uint64_t*>& by_key,
+                     const std::string& key, uint64_t& calls) {
+        auto it = by_key.find(key);
+        if (it == by_key.end()) {
+            return false;
+        }
+        calls = *it->second;
+        return true;
+    }
+
+public:
+    uint64_t* function_counter(llvm::StringRef name) {
+        return counter(functions, name.str());
+    }
+
+    uint64_t* edge_counter(llvm::StringRef caller, llvm::StringRef callee) {
+        return counter(edges, edge_key(caller, callee));
+    }
+
+    // false if there is no count for name
+    bool function_calls(llvm::StringRef name, uint64_t& calls) const {
+        return find(functions, name.str(), calls);
+    }
+
+    uint64_t edge_calls(llvm::StringRef caller, llvm::StringRef callee) const {
+        uint64_t calls = 0;
+        find(edges, edge_key(caller, callee), calls);
+        return calls;
+    }
+
+    // whether a function called this often is among those taking up most
+    // of the calls, by the summary's hot threshold
+    bool is_hot(uint64_t calls) const { return calls >= hot; }
+
+    // the summary tells the passes that the entry counts of module's
+    // functions are from a profile
+    void add_summary(llvm::Module& module) const {
+        if (summary) {
+            module.setProfileSummary(summary->getMD(module.getContext()),
+                                     llvm::ProfileSummary::PSK_Instr);
+        }
+    }
+
+    // gives fn, defined as name, what the profile knows about it
+    void annotate(llvm::Function& fn, llvm::StringRef name) const {
+        uint64_t calls;
+        if (!function_calls(name, calls)) {
+            return;
+        }
+        fn.setEntryCount(calls);
+        if (calls == 0) {
+            fn.addFnAttr(llvm::Attribute::Cold);
+            fn.addFnAttr(llvm::Attribute::OptimizeForSize);
+        } else if (is_hot(calls)) {
+            fn.addFnAttr(llvm::Attribute::Hot);
+        }
+    }
+
+    // sorted by name, so the same counts always make the same file
+    bool write(const char* path) const {
+        FILE* out = fopen(path, "w");
+        if (!out) {
+            stderr_output().error("could not open %s: %s", path,
+                    strerror(errno));
+            return false;
+        }
+        auto sorted = [](const std::unordered_map<std::string, uint64_t*>& m) {
+            std::vector<std::pair<const std::string*, uint64_t>> v;
+            for (const auto& [key, c] : m) {
+                v.emplace_back(&key, *c);
+            }
+            std::sort(v.begin(), v.end(), [](const auto& a, const auto& b) {
+                return *a.first < *b.first;
+            });
+            return v;
+        };
+        for (const auto& [name, calls] : sorted(functions)) {
+            fprintf(out, "function %s %llu\n", name->c_str(),
+                    static_cast<unsigned long long>(calls));
+        }
+        for (const auto& [key, calls] : sorted(edges)) {
+            fprintf(out, "edge %s %llu\n", key->c_str(),
+                    static_cast<unsigned long long>(calls));
+        }
+        bool ok = !ferror(out);
+        ok = fclose(out) == 0 && ok;
+        if (!ok) {
+            stderr_output().error("could not write %s", path);
+        }
+        return ok;
+    }
+
+    // counts of the same name are added up
+    bool read(const char* path) {
+        auto buffer = llvm::MemoryBuffer::getFile(path);
+        if (!buffer) {
+            stderr_output().error("could not open %s: %s", path,
+                    buffer.getError().message().c_str());
+            return false;
+        }
+        llvm::StringRef rest = (*buffer)->getBuffer();
+        for (unsigned line = 1; !rest.empty(); line++) {
+            llvm::StringRef text;
+            std::tie(text, rest) = rest.split('\n');
+            llvm::SmallVector<llvm::StringRef, 4> fields;
+            text.split(fields, ' ', -1, false);
+            if (fields.empty()) {
+                continue;
+            }
+            uint64_t calls = 0;
+            bool ok = !fields.back().getAsInteger(10, calls);
+            if (ok && fields[0] == "function" && fields.size() == 3) {
+                *function_counter(fields[1]) += calls;
+            } else if (ok && fields[0] == "edge" && fields.size() == 4) {
+                *edge_counter(fields[1], fields[2]) += calls;
+            } else {
+                stderr_output().error("%s:%u: malformed profile line", path,
+                        line);
+                return false;
+            }
+        }
+
+        llvm::InstrProfSummaryBuilder builder(
+                llvm::ProfileSummaryBuilder::DefaultCutoffs);
+        for (const auto& entry : functions) {
+            builder.addRecord(llvm::InstrProfRecord({*entry.second}));
+        }
+        summary = builder.getSummary();
+        // nothing is hot in a profile without a single call
+        if (summary->getTotalCount() > 0) {
+            hot = llvm::ProfileSummaryBuilder::getHotCountThreshold(
+                    summary->getDetailedSummary());
+        }
+        return true;
+    }
+};
+
+// set by main for --profile-generate and --profile-use
+static Profile* ProfileGenerate = nullptr;
+static const Profile* ProfileUse = nullptr;
+
+
+/////////////
+/* CODEGEN */
+/////////////
+
+// the LLVMContext and IRBuilder of the calling thread. neither is thread
+// safe and a context is not cheap to set up, so each thread makes one pair
+// and reuses it for every module it generates. the context is held as an
+// orc::ThreadSafeContext so modules built in it can be handed to a JIT.
+struct ThreadCodegenState {
+    llvm::orc::ThreadSafeContext context;
+    llvm::IRBuilder<> builder;
+
+    ThreadCodegenState()
+        : context(std::make_unique<llvm::LLVMContext>()),
+          builder(*context.getContext()) {}
+};
+
+static ThreadCodegenState& thread_codegen_state() {
+    static thread_local ThreadCodegenState state;
+    return state;
+}
+
+static std::nullptr_t log_error_v(const char* str) {
+    stderr_output().error("%s", str);
+    return nullptr;
+}
+
+// emits IR into a module in the calling thread's context. names resolve
+// through SymbolIds: the arguments in scope and the functions of the module
+// are kept in vectors indexed by id rather than in maps keyed by string.
+class CodeGen {
+    const SymbolTable& symbols;
+    ThreadCodegenState& state;
+    llvm::LLVMContext& ctx;
+    llvm::IRBuilder<>& builder;
+    // where its errors go, e.g. a session's output with --serve
+    DiagnosticEngine* diag = &stderr_output();
+    std::unique_ptr<llvm::Module> module;
+    std::string data_layout;
+
+    // arguments of the function being generated
+    std::vector<llvm::Value*> named_values;
+    // functions of the module, filled in as they are looked up
+    std::vector<llvm::Function*> functions;
+
+    // every function declared so far, in this module or in one handed over
+    // with take_module(), so later modules can declare and call it
+    struct Known {
+        int32_t arity = -1;
+        bool defined = false;
+    };
+    std::vector<Known> known;
+
+    // scratch space of the expression walks, kept so they stop allocating
+    struct Pending {
+        Expr* e;
+        bool expanded;
+    };
+    std::vector<Pending> work;
+    std::vector<llvm::Value*> values;
+    std::vector<llvm::Value*> call_args;
+
+    // callees of the definition being generated
+    CallGraph graph;
+    std::vector<SymbolId> body_calls;
+    SymbolId current = sym_anon_expr;
+
+    template <typename T>
+    static T*& slot(std::vector<T*>& table, SymbolId id) {
+        if (id >= table.size()) {
+            table.resize(id + 1, nullptr);
+        }
+        return table[id];
+    }
+
+    llvm::StringRef name_of(SymbolId id) const {
+        std::string_view name = symbols.name(id);
+        return llvm::StringRef(name.data(), name.size());
+    }
+
+    Known& known_slot(SymbolId id) {
+        if (id >= known.size()) {
+            known.resize(id + 1);
+        }
+        return known[id];
+    }
+
+    llvm::Function* declare(SymbolId id, uint32_t n) {
+        std::vector<llvm::Type*> doubles(n, llvm::Type::getDoubleTy(ctx));
+        auto type = llvm::FunctionType::get(llvm::Type::getDoubleTy(ctx),
+                                            doubles, false);
+        auto fn = llvm::Function::Create(type, llvm::Function::ExternalLinkage,
+                                         name_of(id), module.get());
+        slot(functions, id) = fn;
+        return fn;
+    }
+
+    // looks in this module first, then declares functions known from
+    // earlier modules
+    llvm::Function* get_function(SymbolId id) {
+        llvm::Function*& fn = slot(functions, id);
+        if (!fn) {
+            fn = module->getFunction(name_of(id));
+        }
+        if (!fn && id < known.size() && known[id].arity >= 0) {
+            fn = declare(id, known[id].arity);
+        }
+        return fn;
+    }
+
+    // adds one to a counter of ProfileGenerate, which is in this process
+    void emit_count(uint64_t* counter) {
+        llvm::Type* i64 = builder.getInt64Ty();
+        llvm::Value* at = builder.CreateIntToPtr(
+                builder.getInt64(reinterpret_cast<uintptr_t>(counter)),
+                llvm::PointerType::getUnqual(i64));
+        builder.CreateStore(
+                builder.CreateAdd(builder.CreateLoad(i64, at),
+                                  builder.getInt64(1)),
+                at);
+    }
+
+    // as the free one, but to diag
+    std::nullptr_t log_error_v(const char* str) {
+        diag->error("%s", str);
+        return nullptr;
+    }
+
+    llvm::Value* emit_var(SymbolId name) {
+        llvm::Value* v = name < named_values.size() ? named_values[name]
+                                                     : nullptr;
+        if (!v) {
+            return log_error_v("unknown variable name");
+        }
+        return v;
+    }
+
+    llvm::Value* emit_binary(char op, llvm::Value* lhs, llvm::Value* rhs) {
+        switch (op) {
+            case '+':
+                return builder.CreateFAdd(lhs, rhs, "addtmp");
+            case '-':
+                return builder.CreateFSub(lhs, rhs, "subtmp");
+            case '*':
+                return builder.CreateFMul(lhs, rhs, "multmp");
+            case '/':
+                return builder.CreateFDiv(lhs, rhs, "divtmp");
+            case '<': {
+                llvm::Value* cmp = builder.CreateFCmpULT(lhs, rhs, "cmptmp");
+                // 0.0 or 1.0, there are only doubles
+                return builder.CreateUIToFP(cmp, llvm::Type::getDoubleTy(ctx),
+                                            "booltmp");
+            }
+            default:
+                return log_error_v("invalid binary operator");
+        }
+    }
+
+    llvm::Value* emit_call(SymbolId callee, llvm::Value* const* args,
+                           uint32_t n) {
+        llvm::Function* fn = get_function(callee);
+        if (!fn) {
+            return log_error_v("unknown function referenced");
+        }
+        if (fn->arg_size() != n) {
+            return log_error_v("incorrect number of arguments passed");
+        }
+        body_calls.push_back(callee);
+        if (ProfileGenerate && current != sym_anon_expr) {
+            emit_count(ProfileGenerate->edge_counter(name_of(current),
+                                                     name_of(callee)));
+        }
+        return builder.CreateCall(fn, llvm::ArrayRef<llvm::Value*>(args, n),
+                                  "calltmp");
+    }
+
+    // creates the body of the function for proto, with the arguments in
+    // scope while emit_body runs. the function is removed again if
+    // emit_body fails or the result does not verify.
+    //
+    // a function that is defined already is redefined: the new body goes
+    // into a function of its own, which takes the place of the old one
+    // once it is complete. the number of arguments can only change while
+    // nothing else calls it.
+    template <typename EmitBody>
+    llvm::Function* emit_function(FuncPrototype* proto, EmitBody emit_body) {
+        PhaseScope scope(Phase::Codegen);
+        SymbolId name = proto->get_name();
+        uint32_t n = proto->get_args().size();
+
+        llvm::Function* old = get_function(name);
+        bool redefining = old && (!old->empty() || known_slot(name).defined);
+        if (old && old->arg_size() != n) {
+            if (!redefining) {
+                return log_error_v("definition does not match the number of "
+                                   "arguments of the declaration");
+            }
+            if (graph.has_other_callers(name)) {
+                return log_error_v("redefinition changes the number of "
+                                   "arguments of a function still called "
+                                   "elsewhere");
+            }
+        }
+
+        llvm::Function* fn = old;
+        if (!old) {
+            fn = codegen(proto);
+            if (!fn) {
+                return nullptr;
+            }
+        } else if (redefining || old->arg_size() != n) {
+            // named once it replaces old. calls in the body, recursive ones
+            // included, already go to it
+            fn = declare(name, n);
+            fn->setName("");
+        }
+
+        auto bb = llvm::BasicBlock::Create(ctx, "entry", fn);
+        builder.SetInsertPoint(bb);
+
+        uint32_t i = 0;
+        for (llvm::Argument& arg : fn->args()) {
+            SymbolId arg_name =
+                    static_cast<VarExpr*>(proto->get_args()[i++])->get_name();
+            slot(named_values, arg_name) = &arg;
+            arg.setName(name_of(arg_name));
+        }
+
+        // top level expressions are not counted, they run once
+        current = name;
+        if (ProfileGenerate && name != sym_anon_expr) {
+            emit_count(ProfileGenerate->function_counter(name_of(name)));
+        }
+
+        body_calls.clear();
+        llvm::Value* ret = emit_body();
+
+        for (Expr* arg : proto->get_args()) {
+            named_values[static_cast<VarExpr*>(arg)->get_name()] = nullptr;
+        }
+
+        if (ret) {
+            builder.CreateRet(ret);
+            if (!llvm::verifyFunction(*fn, &llvm::errs())) {
+                if (fn != old && old) {
+                    if (old->getFunctionType() == fn->getFunctionType()) {
+                        old->replaceAllUsesWith(fn);
+                    }
+                    old->eraseFromParent();
+                    fn->setName(name_of(name));
+                }
+                // top level expressions come and go under the same name
+                if (name != sym_anon_expr) {
+                    if (ProfileUse) {
+                        ProfileUse->annotate(*fn, name_of(name));
+                    }
+                    Known& k = known_slot(name);
+                    k.arity = n;
+                    k.defined = true;
+                    graph.set_callees(name, body_calls);
+                }
+                return fn;
+            }
+            log_error_v("generated function does not verify");
+        }
+
+        // a failed definition doesn't declare anything either
+        if (!old) {
+            known_slot(name).arity = -1;
+        }
+        erase(fn);
+        if (old && old != fn) {
+            slot(functions, name) = old;
+        }
+        return nullptr;
+    }
+
+public:
+    // in the calling thread's context, or in state's, which the caller
+    // makes sure only one thread at a time uses
+    CodeGen(const SymbolTable& symbols, const char* module_name)
+        : CodeGen(symbols, module_name, thread_codegen_state()) {}
+    CodeGen(const SymbolTable& symbols, const char* module_name,
+            ThreadCodegenState& state)
+        : symbols(symbols),
+          state(state),
+          ctx(*state.context.getContext()),
+          builder(state.builder),
+          module(std::make_unique<llvm::Module>(module_name, ctx)) {
+        if (ProfileUse) {
+            ProfileUse->add_summary(*module);
+        }
+    }
+
+    llvm::Module& get_module() { return *module; }
+
+    // errors go to engine from now on, stderr until then
+    void set_diagnostics(DiagnosticEngine& engine) { diag = &engine; }
+    const llvm::orc::ThreadSafeContext& get_context() const {
+        return state.context;
+    }
+
+    // lets the modules call id, which is defined or declared elsewhere
+    void declare_known(SymbolId id, uint32_t arity) {
+        known_slot(id).arity = arity;
+    }
+
+    // arguments of id if it has been declared so far, -1 otherwise
+    int32_t known_arity(SymbolId id) const {
+        return id < known.size() ? known[id].arity : -1;
+    }
+
+    // layout of the target the modules are for, from now on
+    void set_data_layout(const llvm::DataLayout& layout) {
+        data_layout = layout.getStringRepresentation();
+        module->setDataLayout(data_layout);
+    }
+
+    // hands over the module built so far and starts an empty one. the
+    // functions in it stay known, later modules declare what they use.
+    std::unique_ptr<llvm::Module> take_module(const char* next_name) {
+        functions.clear();
+        auto next = std::make_unique<llvm::Module>(next_name, ctx);
+        next->setDataLayout(data_layout);
+        if (ProfileUse) {
+            ProfileUse->add_summary(*next);
+        }
+        return std::exchange(module, std::move(next));
+    }
+
+    // removes a function from the module, e.g. a top level expression once
+    // it has been used
+    void erase(llvm::Function* fn) {
+        for (llvm::Function*& f : functions) {
+            if (f == fn) {
+                f = nullptr;
+            }
+        }
+        fn->eraseFromParent();
+    }
+
+    // walks the tree with an explicit stack since trees from the explicit
+    // stack parser are too deep to recurse over
+    llvm::Value* codegen(Expr* root) {
+        work.clear();
+        values.clear();
+        work.push_back(Pending{root, false});
+
+        while (!work.empty()) {
+            Expr* e = work.back().e;
+            bool expanded = work.back().expanded;
+            llvm::Value* v = nullptr;
+
+            switch (e->get_kind()) {
+                case ExprKind::Num:
+                    v = llvm::ConstantFP::get(ctx, llvm::APFloat(
+                            static_cast<NumExpr*>(e)->get_val()));
+                    break;
+
+                case ExprKind::Var:
+                    v = emit_var(static_cast<VarExpr*>(e)->get_name());
+                    if (!v) {
+                        return nullptr;
+                    }
+                    break;
+
+                case ExprKind::Binary: {
+                    auto bin = static_cast<BinaryExpr*>(e);
+                    if (!expanded) {
+                        // operands first, lhs on top so it is emitted first
+                        work.back().expanded = true;
+                        work.push_back(Pending{bin->get_rhs(), false});
+                        work.push_back(Pending{bin->get_lhs(), false});
+                        continue;
+                    }
+                    llvm::Value* rhs = values.back();
+                    values.pop_back();
+                    llvm::Value* lhs = values.back();
+                    values.pop_back();
+                    v = emit_binary(bin->get_op(), lhs, rhs);
+                    if (!v) {
+                        return nullptr;
+                    }
+                    break;
+                }
+
+                case ExprKind::Call: {
+                    auto call = static_cast<CallExpr*>(e);
+                    const ArenaArray<Expr*>& args = call->get_args();
+                    if (!expanded) {
+                        work.back().expanded = true;
+                        for (uint32_t i = args.size(); i-- > 0;) {
+                            work.push_back(Pending{args[i], false});
+                        }
+                        continue;
+                    }
+                    llvm::Value** first = values.data() + values.size()
+                            - args.size();
+                    v = emit_call(call->get_callee(), first, args.size());
+                    if (!v) {
+                        return nullptr;
+                    }
+                    values.resize(values.size() - args.size());
+                    break;
+                }
+
+                case ExprKind::Function:
+                    return log_error_v("function used as an expression");
+            }
+
+            work.pop_back();
+            values.push_back(v);
+        }
+
+        return values.back();
+    }
+
+    // a body in a FlatExprPool needs no walk: operands always come before
+    // the node using them, so the ids from first to the body are generated
+    // in order
+    llvm::Value* codegen(const FlatExprPool& pool, ExprId first,
+                         ExprId root) {
+        uint32_t base = first.index;
+        values.assign(root.index - base + 1, nullptr);
+
+        for (uint32_t i = base; i <= root.index; i++) {
+            ExprId id{i};
+            llvm::Value* v = nullptr;
+            switch (pool.kind(id)) {
+                case FlatKind::Num:
+                    v = llvm::ConstantFP::get(ctx,
+                                              llvm::APFloat(pool.literal(id)));
+                    break;
+                case FlatKind::Var:
+                    v = emit_var(pool.symbol(id));
+                    break;
+                case FlatKind::Binary:
+                    v = emit_binary(pool.op(id),
+                                    values[pool.lhs(id).index - base],
+                                    values[pool.rhs(id).index - base]);
+                    break;
+                case FlatKind::Call: {
+                    uint32_t n = pool.arg_count(id);
+                    call_args.resize(n);
+                    for (uint32_t a = 0; a < n; a++) {
+                        call_args[a] = values[pool.arg(id, a).index - base];
+                    }
+                    v = emit_call(pool.symbol(id), call_args.data(), n);
+                    break;
+                }
+            }
+            if (!v) {
+                return nullptr;
+            }
+            values[i - base] = v;
+        }
+
+        return values[root.index - base];
+    }
+
+    llvm::Function* codegen(FuncPrototype* proto) {
+        PhaseScope scope(Phase::Codegen);
+        uint32_t n = proto->get_args().size();
+        if (llvm::Function* existing = get_function(proto->get_name())) {
+            if (existing->arg_size() != n) {
+                return log_error_v("redeclaration with a different number "
+                                   "of arguments");
+            }
+            return existing;
+        }
+
+        llvm::Function* fn = declare(proto->get_name(), n);
+        uint32_t i = 0;
+        for (llvm::Argument& arg : fn->args()) {
+            auto var = static_cast<VarExpr*>(proto->get_args()[i++]);
+            arg.setName(name_of(var->get_name()));
+        }
+
+        if (proto->get_name() != sym_anon_expr) {
+            known_slot(proto->get_name()).arity = n;
+        }
+        return fn;
+    }
+
+    llvm::Function* codegen(FunctionExpr* fn) {
+        return emit_function(fn->get_proto(),
+                             [&] { return codegen(fn->get_body()); });
+    }
+
+    llvm::Function* codegen(const FlatFunction& fn) {
+        return emit_function(fn.proto, [&] {
+            return codegen(*fn.pool, fn.first, fn.body);
+        });
+    }
+
+    // for what a Parser<B>::Func holds, whichever the builder
+    llvm::Function* codegen_function(Expr* fn) {
+        return codegen(static_cast<FunctionExpr*>(fn));
+    }
+    llvm::Function* codegen_function(const FlatFunction& fn) {
+        return codegen(fn);
+    }
+
+    // name of the adapter of a function of n arguments, see
+    // codegen_adapter()
+    std::string adapter_name(SymbolId id, uint32_t n) const {
+        return std::string(symbols.name(id)) + ".args" + std::to_string(n);
+    }
+
+    // emits
+    //      double name.args<n>(double* args)
+    // which calls the already declared function name with args[0] to
+    // args[n - 1], so all compiled functions can be called from C++
+    // through the one signature whatever their arity. the '.' keeps the
+    // name out of the way of anything the language can name.
+    llvm::Function* codegen_adapter(SymbolId id) {
+        PhaseScope scope(Phase::Codegen);
+        llvm::Function* target = get_function(id);
+        if (!target) {
+            return log_error_v("unknown function referenced");
+        }
+
+        llvm::Type* dbl = llvm::Type::getDoubleTy(ctx);
+        auto type = llvm::FunctionType::get(
+                dbl, {llvm::PointerType::getUnqual(dbl)}, false);
+        auto fn = llvm::Function::Create(type, llvm::Function::ExternalLinkage,
+                                         adapter_name(id, target->arg_size()),
+                                         module.get());
+
+        builder.SetInsertPoint(llvm::BasicBlock::Create(ctx, "entry", fn));
+        llvm::Value* args = fn->getArg(0);
+        call_args.resize(target->arg_size());
+        for (uint32_t i = 0; i < call_args.size(); i++) {
+            call_args[i] = builder.CreateLoad(
+                    dbl, builder.CreateConstInBoundsGEP1_64(dbl, args, i));
+        }
+        builder.CreateRet(builder.CreateCall(target, call_args));
+
+        if (llvm::verifyFunction(*fn, &llvm::errs())) {
+            fn->eraseFromParent();
+            return log_error_v("generated function does not verify");
+        }
+        return fn;
+    }
+
+    // emits, into the module of kernel (which must be in this thread's
+    // context),
+    //      void name.batch(double** cols, double* out, i64 begin, i64 end)
+    // which sets out[i] to kernel(cols[0][i], ..., cols[n - 1][i]) for
+    // every row i in [begin, end). out is noalias and the columns are only
+    // read, so once kernel is inlined into the loop it vectorizes without
+    // runtime alias checks.
+    llvm::Function* codegen_batch(llvm::Function* kernel,
+                                  llvm::StringRef name) {
+        PhaseScope scope(Phase::Codegen);
+        llvm::Type* dbl = llvm::Type::getDoubleTy(ctx);
+        llvm::Type* ptr = llvm::PointerType::getUnqual(dbl);
+        llvm::Type* i64 = llvm::Type::getInt64Ty(ctx);
+        auto type = llvm::FunctionType::get(
+                llvm::Type::getVoidTy(ctx),
+                {llvm::PointerType::getUnqual(ptr), ptr, i64, i64}, false);
+        auto fn = llvm::Function::Create(type, llvm::Function::ExternalLinkage,
+                                         name + ".batch", kernel->getParent());
+        fn->addParamAttr(0, llvm::Attribute::ReadOnly);
+        fn->addParamAttr(0, llvm::Attribute::NoAlias);
+        fn->addParamAttr(1, llvm::Attribute::NoAlias);
+        llvm::Value* cols = fn->getArg(0);
+        llvm::Value* out = fn->getArg(1);
+        llvm::Value* begin = fn->getArg(2);
+        llvm::Value* end = fn->getArg(3);
+
+        auto entry = llvm::BasicBlock::Create(ctx, "entry", fn);
+        auto loop = llvm::BasicBlock::Create(ctx, "loop", fn);
+        auto exit = llvm::BasicBlock::Create(ctx, "exit", fn);
+
+        // the column pointers are loaded once, outside the loop
+        builder.SetInsertPoint(entry);
+        std::vector<llvm::Value*> columns(kernel->arg_size());
+        for (uint32_t a = 0; a < columns.size(); a++) {
+            columns[a] = builder.CreateLoad(
+                    ptr, builder.CreateConstInBoundsGEP1_64(ptr, cols, a),
+                    "col");
+        }
+        builder.CreateCondBr(builder.CreateICmpSLT(begin, end), loop, exit);
+
+        builder.SetInsertPoint(loop);
+        llvm::PHINode* row = builder.CreatePHI(i64, 2, "row");
+        row->addIncoming(begin, entry);
+        call_args.resize(columns.size());
+        for (uint32_t a = 0; a < columns.size(); a++) {
+            call_args[a] = builder.CreateLoad(
+                    dbl, builder.CreateInBoundsGEP(dbl, columns[a], row));
+        }
+        builder.CreateStore(builder.CreateCall(kernel, call_args),
+                            builder.CreateInBoundsGEP(dbl, out, row));
+        llvm::Value* next = builder.CreateAdd(row, builder.getInt64(1), "next",
+                                              true, true);
+        row->addIncoming(next, loop);
+        builder.CreateCondBr(builder.CreateICmpSLT(next, end), loop, exit);
+
+        builder.SetInsertPoint(exit);
+        builder.CreateRetVoid();
+
+        if (llvm::verifyFunction(*fn, &llvm::errs())) {
+            fn->eraseFromParent();
+            return log_error_v("generated function does not verify");
+        }
+        return fn;
+    }
+};
+
+
+//////////////////
+/* OPTIMIZATION */
+//////////////////
+
+// 0 to 3, set with -O<n>
+static int OptLevel = 2;
+
+// pass pipelines on the new pass manager, for the calling thread only.
+// code for the jit is compiled while the user waits, so it gets a cheap
+// pipeline run over one function at a time. whole modules built ahead of
+// time get the default per module pipeline of the level. at -O0 neither
+// does anything. given a TargetMachine the passes know the target, e.g.
+// the vector width the loop vectorizer can use.
+class Optimizer {
+    int level;
+
+    llvm::LoopAnalysisManager lam;
+    llvm::FunctionAnalysisManager fam;
+    llvm::CGSCCAnalysisManager cgam;
+    llvm::ModuleAnalysisManager mam;
+    llvm::PassBuilder pb;
+
+    llvm::FunctionPassManager fpm;
+    llvm::ModulePassManager mpm;
+
+    // cached analyses refer to the IR they were computed for, which the
+    // caller is free to delete afterwards
+    void clear_analyses() {
+        lam.clear();
+        fam.clear();
+        cgam.clear();
+        mam.clear();
+    }
+
+public:
+    explicit Optimizer(int level, llvm::TargetMachine* tm = nullptr)
+        : level(level), pb(tm) {
+        pb.registerModuleAnalyses(mam);
+        pb.registerCGSCCAnalyses(cgam);
+        pb.registerFunctionAnalyses(fam);
+        pb.registerLoopAnalyses(lam);
+        pb.crossRegisterProxies(lam, fam, cgam, mam);
+
+        if (level == 0) {
+            return;
+        }
+
+        fpm.addPass(llvm::PromotePass());
+        fpm.addPass(llvm::InstCombinePass());
+        fpm.addPass(llvm::ReassociatePass());
+        fpm.addPass(llvm::GVNPass());
+        fpm.addPass(llvm::SimplifyCFGPass());
+
+        static const llvm::OptimizationLevel levels[] = {
+            llvm::OptimizationLevel::O1,
+            llvm::OptimizationLevel::O2,
+            llvm::OptimizationLevel::O3,
+        };
+        mpm = pb.buildPerModuleDefaultPipeline(levels[level - 1]);
+    }
+
+    int get_level() const { return level; }
+
+    void optimize_function(llvm::Function& fn) {
+        if (level == 0 || fn.isDeclaration()) {
+            return;
+        }
+        PhaseScope scope(Phase::Optimize);
+        fpm.run(fn, fam);
+        clear_analyses();
+    }
+
+    void optimize_module(llvm::Module& module) {
+        if (level == 0) {
+            return;
+        }
+        PhaseScope scope(Phase::Optimize);
+        mpm.run(module, mam);
+        clear_analyses();
+    }
+
+    // runs the thin lto pre-link pipeline of the level over module, which
+    // leaves what is worth doing across modules to the link, and writes
+    // it to out as bitcode with the summary the link works from
+    void thin_lto_prelink(llvm::Module& module, llvm::raw_ostream& out) {
+        static const llvm::OptimizationLevel levels[] = {
+            llvm::OptimizationLevel::O1,
+            llvm::OptimizationLevel::O2,
+            llvm::OptimizationLevel::O3,
+        };
+        PhaseScope scope(Phase::Optimize);
+        llvm::ModulePassManager prelink;
+        if (level > 0) {
+            prelink = pb.buildThinLTOPreLinkDefaultPipeline(levels[level - 1]);
+        }
+        prelink.addPass(llvm::ThinLTOBitcodeWriterPass(out, nullptr));
+        prelink.run(module, mam);
+        clear_analyses();
+    }
+};
+
+
+//////////////////
+/* OBJECT CACHE */
+//////////////////
+
+// object code of compiled modules kept in a directory across runs, set
+// with --cache=<dir>. a module is looked up by a hash of its IR as codegen
+// emitted it, before any optimization. that IR follows from the AST of the
+// functions in it and the declarations they call, so a prelude that hasn't
+// changed is neither optimized nor compiled again. the hash also covers the
+// target triple, cpu, its features, the optimization level and the LLVM
+// version, since all of them change the object code.
+class ObjectCacheDir : public llvm::ObjectCache {
+    static constexpr const char* key_prefix = "kcache.";
+
+    std::string dir;
+    // everything but the IR that goes into a key
+    std::string target;
+
+    std::string path_of(llvm::StringRef key) const {
+        return dir + "/" + key.str() + ".o";
+    }
+
+    // the key of a module that has one, empty otherwise
+    static llvm::StringRef key_of(const llvm::Module& module) {
+        llvm::StringRef id = module.getModuleIdentifier();
+        return id.startswith(key_prefix) ? id : llvm::StringRef();
+    }
+
+public:
+    uint32_t hits = 0;
+    uint32_t stored = 0;
+
+    bool open(const char* path) {
+        dir = path;
+        if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+            stderr_output().error("could not create %s: %s", path,
+                    strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    void set_target(const llvm::orc::JITTargetMachineBuilder& jtmb) {
+        target = jtmb.getTargetTriple().str() + "\n" + jtmb.getCPU() + "\n"
+                + jtmb.getFeatures().getString() + "\n-O"
+                + std::to_string(OptLevel) + "\n" LLVM_VERSION_STRING "\n";
+    }
+
+    // names module by its key, true if its object is in the cache already.
+    // top level expressions run once, so they are left alone.
+    bool assign_key(llvm::Module& module) {
+        if (module.getFunction("__anon_expr")) {
+            return false;
+        }
+
+        // the names are whatever the jit made up for the partition
+        module.setModuleIdentifier("");
+        module.setSourceFileName("");
+        std::string ir;
+        llvm::raw_string_ostream os(ir);
+        module.print(os, nullptr);
+        os.flush();
+
+        llvm::SHA1 sha;
+        sha.update(target);
+        sha.update(ir);
+        std::string key = key_prefix + llvm::toHex(sha.final(), true);
+        module.setModuleIdentifier(key);
+        return access(path_of(key).c_str(), R_OK) == 0;
+    }
+
+    void notifyObjectCompiled(const llvm::Module* module,
+                              llvm::MemoryBufferRef obj) override {
+        llvm::StringRef key = key_of(*module);
+        if (key.empty()) {
+            return;
+        }
+
+        // written under a name of its own and renamed into place, so other
+        // processes sharing the directory never see half of it
+        std::string path = path_of(key);
+        std::string tmp = path + "." + std::to_string(getpid());
+        FILE* f = fopen(tmp.c_str(), "wb");
+        if (!f) {
+            return;
+        }
+        bool ok = fwrite(obj.getBufferStart(), 1, obj.getBufferSize(), f)
+                == obj.getBufferSize();
+        ok = fclose(f) == 0 && ok;
+        if (ok && rename(tmp.c_str(), path.c_str()) == 0) {
+            stored++;
+        } else {
+            unlink(tmp.c_str());
+        }
+    }
+
+    std::unique_ptr<llvm::MemoryBuffer> getObject(
+            const llvm::Module* module) override {
+        llvm::StringRef key = key_of(*module);
+        if (key.empty()) {
+            return nullptr;
+        }
+        auto buffer = llvm::MemoryBuffer::getFile(path_of(key), false, false);
+        if (!buffer) {
+            return nullptr;
+        }
+        hits++;
+        return std::move(*buffer);
+    }
+};
+
+
+/////////
+/* JIT */
+/////////
+
+// runs the modules of a CodeGen on an orc::LLLazyJIT. definitions only get
+// a stub when they are added and each function is compiled the first time
+// it is called, so a prelude of definitions that are never used costs no
+// more than their codegen. top level expressions are compiled right away,
+// run once and then dropped again through a ResourceTracker of their own.
+// everything is run through the Optimizer's function pipeline as it is
+// compiled, unless its object code comes from the ObjectCacheDir.
+// definitions can be replaced, see Library below.
+class Jit {
+public:
+    // a JITDylib and the stubs of the definitions in it. every definition
+    // is reached through a stub under its own name, which points at the
+    // current version of its code. a redefinition adds the new version and
+    // repoints the stub, so code calling it, compiled or not, never has to
+    // change. old versions stay in memory until the library is cleared,
+    // the lazy layer has no way of removing them one by one.
+    //
+    // the main library has what the jit is given without one, and the
+    // symbols of the process. the others, see create_library(), each see
+    // their own definitions first and the main library's behind them.
+    struct Library {
+        llvm::orc::JITDylib* dylib = nullptr;
+        std::unique_ptr<llvm::orc::IndirectStubsManager> stubs;
+        llvm::StringMap<uint32_t> versions;
+    };
+
+private:
+    std::unique_ptr<llvm::orc::LLLazyJIT> jit;
+    Library main;
+    llvm::Triple triple;
+
+    // for the host, with its cpu and features, as the jit compiles for
+    std::unique_ptr<llvm::TargetMachine> tm;
+
+    // code is compiled on the first thread to call it, which with --serve
+    // is any one of its pool. the Optimizer, the TargetMachine of the
+    // compiler and the cache are used by one thread at a time.
+    std::mutex compile_mutex;
+
+    // where errors on this thread go, see DiagnosticsScope. functions are
+    // compiled on the thread that first calls them, so their errors are
+    // reported there too.
+    static inline thread_local DiagnosticEngine* diagnostics = nullptr;
+
+    static DiagnosticEngine& diag() {
+        return diagnostics ? *diagnostics : stderr_output();
+    }
+
+    static bool report(llvm::Error err) {
+        if (!err) {
+            return true;
+        }
+        diag().error("%s", llvm::toString(std::move(err)).c_str());
+        return false;
+    }
+
+    // called in place of a function whose lazy compile failed. it takes
+    // whatever arguments the caller passed, all functions return a double.
+    static double compile_failed() {
+        diag().error("function could not be compiled");
+        faulted = true;
+        return 0;
+    }
+
+    // set by compile_failed on the thread that called it, so run() can
+    // drop the result it made up, like Interpreter::faulted
+    static inline thread_local bool faulted = false;
+
+    // the compiler of the compile layer, timed. a lazily added function is
+    // compiled in the middle of the call reaching it, which would otherwise
+    // be charged to execute.
+    class TimedCompiler : public llvm::orc::IRCompileLayer::IRCompiler {
+        std::unique_ptr<IRCompiler> inner;
+        std::mutex& mutex;
+
+    public:
+        TimedCompiler(std::unique_ptr<IRCompiler> inner, std::mutex& mutex)
+            : IRCompiler(inner->getManglingOptions()),
+              inner(std::move(inner)),
+              mutex(mutex) {}
+
+        llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>> operator()(
+                llvm::Module& module) override {
+            PhaseScope scope(Phase::JitLink);
+            std::lock_guard<std::mutex> lock(mutex);
+            return (*inner)(module);
+        }
+    };
+
+    Library& library(Library* lib) { return lib ? *lib : main; }
+
+    // gives lib a stub of its own for each definition of the main library,
+    // pointing at the main one's. code in lib calls those, so a definition
+    // in lib replaces one of the main library's as far as lib is concerned,
+    // code compiled before it included.
+    bool link_main(Library& lib) {
+        lib.stubs = llvm::orc::createLocalIndirectStubsManagerBuilder(
+                triple)();
+        llvm::orc::IndirectStubsManager::StubInitsMap inits;
+        auto flags = llvm::JITSymbolFlags::Exported
+                | llvm::JITSymbolFlags::Callable;
+        for (const auto& entry : main.versions) {
+            llvm::JITEvaluatedSymbol sym =
+                    main.stubs->findStub(entry.getKey(), false);
+            inits[entry.getKey()] = {sym.getAddress(), flags};
+        }
+        if (inits.empty()) {
+            return true;
+        }
+        if (!report(lib.stubs->createStubs(inits))) {
+            return false;
+        }
+        llvm::orc::SymbolMap symbols;
+        for (const auto& init : inits) {
+            symbols[jit->mangleAndIntern(init.getKey())] =
+                    lib.stubs->findStub(init.getKey(), false);
+        }
+        return report(lib.dylib->define(
+                llvm::orc::absoluteSymbols(std::move(symbols))));
+    }
+
+public:
+    // sends what goes wrong in the jit on this thread to engine instead of
+    // stderr while it lives, e.g. for a line of a --serve session
+    class DiagnosticsScope {
+        DiagnosticEngine* prev;
+
+    public:
+        explicit DiagnosticsScope(DiagnosticEngine& engine)
+            : prev(std::exchange(diagnostics, &engine)) {}
+        ~DiagnosticsScope() { diagnostics = prev; }
+
+        DiagnosticsScope(const DiagnosticsScope&) = delete;
+        DiagnosticsScope& operator=(const DiagnosticsScope&) = delete;
+    };
+
+    // sets up the jit for the host, with the symbols of the process (libm
+    // for instance) available to externs. opt and cache, if there is one,
+    // must outlive the jit.
+    bool init(Optimizer& opt, ObjectCacheDir* cache) {
+        llvm::InitializeNativeTarget();
+        llvm::InitializeNativeTargetAsmPrinter();
+        llvm::InitializeNativeTargetAsmParser();
+
+        auto jtmb = llvm::orc::JITTargetMachineBuilder::detectHost();
+        if (!jtmb) {
+            return report(jtmb.takeError());
+        }
+
+        llvm::orc::LLLazyJITBuilder builder;
+        builder.setJITTargetMachineBuilder(*jtmb)
+                .setLazyCompileFailureAddr(
+                        llvm::pointerToJITTargetAddress(&compile_failed));
+        if (cache) {
+            cache->set_target(*jtmb);
+        }
+        builder.setCompileFunctionCreator(
+                [this, cache](llvm::orc::JITTargetMachineBuilder jtmb)
+                        -> llvm::Expected<std::unique_ptr<
+                                llvm::orc::IRCompileLayer::IRCompiler>> {
+                    auto tm = jtmb.createTargetMachine();
+                    if (!tm) {
+                        return tm.takeError();
+                    }
+                    return std::make_unique<TimedCompiler>(
+                            std::make_unique<
+                                    llvm::orc::TMOwningSimpleCompiler>(
+                                    std::move(*tm), cache),
+                            compile_mutex);
+                });
+
+        auto created = builder.create();
+        if (!created) {
+            return report(created.takeError());
+        }
+        jit = std::move(*created);
+        // e.g. symbols a lazily compiled function could not find, which
+        // otherwise go straight to llvm::errs()
+        jit->getExecutionSession().setErrorReporter(
+                [](llvm::Error err) { report(std::move(err)); });
+        auto host = jtmb->createTargetMachine();
+        if (!host) {
+            return report(host.takeError());
+        }
+        tm = std::move(*host);
+        triple = jtmb->getTargetTriple();
+        main.dylib = &jit->getMainJITDylib();
+        main.stubs = llvm::orc::createLocalIndirectStubsManagerBuilder(
+                triple)();
+
+        // one function per partition instead of the whole module, so
+        // calling one of several definitions in a module compiles just it
+        jit->setPartitionFunction(
+                llvm::orc::CompileOnDemandLayer::compileRequested);
+
+        auto process = llvm::orc::DynamicLibrarySearchGenerator::
+                GetForCurrentProcess(jit->getDataLayout().getGlobalPrefix());
+        if (!process) {
+            return report(process.takeError());
+        }
+        jit->getMainJITDylib().addGenerator(std::move(*process));
+
+        // below the lazy layer, so it only sees what is being compiled.
+        // the compile layer below asks the cache for the object by the key
+        // given here.
+        jit->getIRTransformLayer().setTransform(
+                [this, &opt, cache](llvm::orc::ThreadSafeModule tsm,
+                                    llvm::orc::MaterializationResponsibility&) {
+                    tsm.withModuleDo([&](llvm::Module& module) {
+                        // after the context's lock, as in the compile layer
+                        std::lock_guard<std::mutex> lock(compile_mutex);
+                        if (cache && cache->assign_key(module)) {
+                            return;
+                        }
+                        for (llvm::Function& fn : module) {
+                            opt.optimize_function(fn);
+                        }
+                    });
+                    return llvm::Expected<llvm::orc::ThreadSafeModule>(
+                            std::move(tsm));
+                });
+        return true;
+    }
+
+    const llvm::DataLayout& get_data_layout() const {
+        return jit->getDataLayout();
+    }
+
+    llvm::TargetMachine* get_target_machine() { return tm.get(); }
+
+    // adds the definitions in module to lib, or replaces the ones it has
+    // already. nothing in module is compiled until it is called.
+    bool add_definitions(std::unique_ptr<llvm::Module> module,
+                         const llvm::orc::ThreadSafeContext& context,
+                         Library* lib = nullptr) {
+        PhaseScope scope(Phase::JitLink);
+        Library& l = library(lib);
+        // each definition f becomes f.<version>, and everything in module
+        // calls the stub f instead, recursive calls included. names with a
+        // '.' are not from the language and are added as they are.
+        std::vector<std::pair<std::string, std::string>> renamed;
+        std::vector<llvm::Function*> defined;
+        for (llvm::Function& fn : *module) {
+            if (!fn.isDeclaration() && !fn.getName().contains('.')) {
+                defined.push_back(&fn);
+            }
+        }
+        for (llvm::Function* fn : defined) {
+            std::string name = fn->getName().str();
+            std::string impl = name + "." + std::to_string(l.versions[name]++);
+            fn->setName(impl);
+            auto stub = llvm::Function::Create(fn->getFunctionType(),
+                                               llvm::Function::ExternalLinkage,
+                                               name, module.get());
+            fn->replaceAllUsesWith(stub);
+            renamed.emplace_back(std::move(name), std::move(impl));
+        }
+
+        if (!report(jit->addLazyIRModule(*l.dylib, llvm::orc::ThreadSafeModule(
+                std::move(module), context)))) {
+            return false;
+        }
+
+        for (auto& [name, impl] : renamed) {
+            // the lazy layer's own stub, still nothing is compiled
+            auto sym = jit->lookup(*l.dylib, impl);
+            if (!sym) {
+                report(sym.takeError());
+                continue;
+            }
+            if (l.stubs->findStub(name, false)) {
+                report(l.stubs->updatePointer(name, sym->getAddress()));
+                continue;
+            }
+
+            auto flags = llvm::JITSymbolFlags::Exported
+                    | llvm::JITSymbolFlags::Callable;
+            if (!report(l.stubs->createStub(name, sym->getAddress(),
+                                            flags))) {
+                continue;
+            }
+            report(l.dylib->define(llvm::orc::absoluteSymbols(
+                    {{jit->mangleAndIntern(name),
+                      l.stubs->findStub(name, false)}})));
+        }
+        return true;
+    }
+
+    // address of a symbol of lib, or of the main library behind it, nullptr
+    // if there is none. for a lazily added function that is its stub,
+    // nothing is compiled yet.
+    void* lookup(const std::string& name, Library* lib = nullptr) {
+        PhaseScope scope(Phase::JitLink);
+        auto sym = jit->lookup(*library(lib).dylib, name);
+        if (!sym) {
+            report(sym.takeError());
+            return nullptr;
+        }
+        return llvm::jitTargetAddressToPointer<void*>(sym->getAddress());
+    }
+
+    // adds module as it is, under a ResourceTracker of its own which
+    // remove() takes it out with again. nothing lazy about it: looking up
+    // anything in it compiles all of it. nullptr if it can't be added.
+    llvm::orc::ResourceTrackerSP add_module(
+            std::unique_ptr<llvm::Module> module,
+            const llvm::orc::ThreadSafeContext& context) {
+        PhaseScope scope(Phase::JitLink);
+        auto tracker = jit->getMainJITDylib().createResourceTracker();
+        if (!report(jit->addIRModule(tracker, llvm::orc::ThreadSafeModule(
+                std::move(module), context)))) {
+            return nullptr;
+        }
+        return tracker;
+    }
+
+    bool remove(const llvm::orc::ResourceTrackerSP& tracker) {
+        return report(tracker->remove());
+    }
+
+    // a library of its own named name, empty but for the main library
+    // behind it. nullptr if it can't be made. it stays with the jit, a
+    // library no longer needed is cleared and used again. definitions the
+    // main library gets later are only seen by libraries made or cleared
+    // after.
+    std::unique_ptr<Library> create_library(const std::string& name) {
+        auto dylib = jit->createJITDylib(name);
+        if (!dylib) {
+            report(dylib.takeError());
+            return nullptr;
+        }
+        auto lib = std::make_unique<Library>();
+        lib->dylib = &*dylib;
+        lib->dylib->addToLinkOrder(*main.dylib);
+        if (!link_main(*lib)) {
+            return nullptr;
+        }
+        return lib;
+    }
+
+    // removes everything added to lib, compiled code included, as if it
+    // had just been created
+    bool clear_library(Library& lib) {
+        bool ok = report(lib.dylib->clear());
+        // where the lazy layer keeps the code of lib's definitions
+        if (auto impl = jit->getExecutionSession().getJITDylibByName(
+                lib.dylib->getName() + ".impl")) {
+            ok = report(impl->clear()) && ok;
+        }
+        lib.versions.clear();
+        return link_main(lib) && ok;
+    }
+
+    // compiles module in lib, calls its function name and removes the
+    // module again. false if any of that fails, or if a function it called
+    // could not be compiled.
+    bool run(std::unique_ptr<llvm::Module> module,
+             const llvm::orc::ThreadSafeContext& context, const char* name,
+             double& result, Library* lib = nullptr) {
+        auto tracker = library(lib).dylib->createResourceTracker();
+        {
+            PhaseScope scope(Phase::JitLink);
+            if (!report(jit->addIRModule(tracker, llvm::orc::ThreadSafeModule(
+                    std::move(module), context)))) {
+                return false;
+            }
+        }
+
+        // compiles and links it
+        void* addr = lookup(name, lib);
+        faulted = false;
+        if (addr) {
+            PhaseScope scope(Phase::Execute);
+            result = reinterpret_cast<double (*)()>(addr)();
+        }
+
+        return report(tracker->remove()) && addr && !faulted;
+    }
+};
+
+
+/////////////////
+/* INTERPRETER */
+/////////////////
+
+// tier 0 of --tiered. definitions and top level expressions are run here
+// without going through LLVM at all, and a definition is only handed to
+// the jit once it has been called often enough to be worth compiling.
+//
+// bodies are kept as FlatExprPools, one per function since the repl's
+// ASTs are dropped after each item. operands come before the node using
+// them, so a body runs as one pass over its nodes with no recursion other
+// than for calls. there is no control flow in the language, every node is
+// always evaluated.
+
+// calls of a definition after which --tiered compiles it. with
+// --profile-use the ones the profile has as hot are compiled on their
+// first call instead.
+static uint32_t TierUpCalls = 1000;
+
+class Interpreter {
+    using NativeFn = double (*)(const double*);
+
+    struct TierFunction {
+        // copies in protos, the prototypes the repl parsed are dropped
+        FuncPrototype* proto = nullptr;
+        FlatExprPool body;
+        // invalid for externs, which only run compiled
+        ExprId root;
+        // argument index of each Var node of body, by node id
+        std::vector<uint32_t> slots;
+
+        uint32_t calls = 0;
+        uint32_t tier_up = TierUpCalls;
+        // with --profile-generate, the counter of its calls and those of
+        // the call nodes of body, by node id
+        uint64_t* counter = nullptr;
+        std::vector<uint64_t*> edge_counters;
+        // body emitted into a module of the jit (always for externs)
+        bool in_jit = false;
+        // compiling it failed, keep interpreting it
+        bool failed = false;
+        // the adapter of the compiled function, once there is one
+        NativeFn native = nullptr;
+        // argument counts the jit has an adapter for
+        std::vector<uint32_t> adapters;
+    };
+
+    const SymbolTable& symbols;
+    CodeGen& cg;
+    Jit& jit;
+    AstContext protos;
+
+    // indexed by SymbolId, proto is nullptr for unknown names
+    std::vector<TierFunction> functions;
+
+    // the top level expression being run
+    TierFunction anon;
+    // a definition until it has been checked
+    TierFunction pending;
+
+    CallGraph graph;
+    std::vector<SymbolId> body_calls;
+
+    // scratch space, kept so it stops allocating
+    struct Pending {
+        Expr* e;
+        bool expanded;
+    };
+    std::vector<Pending> work;
+    std::vector<ExprId> ids;
+    std::vector<SymbolId> reachable;
+    std::vector<bool> seen;
+
+    // frames of the functions being interpreted, arguments first and then
+    // one value per node
+    std::vector<double> stack;
+    // an extern was called that could not be compiled, the result of the
+    // expression is garbage
+    bool faulted = false;
+
+    TierFunction* find(SymbolId id) {
+        return id < functions.size() && functions[id].proto ? &functions[id]
+                                                            : nullptr;
+    }
+
+    FuncPrototype* copy_proto(FuncPrototype* proto) {
+        const ArenaArray<Expr*>& args = proto->get_args();
+        Expr** copied = static_cast<Expr**>(protos.allocate(
+                sizeof(Expr*) * args.size(), alignof(Expr*)));
+        for (uint32_t i = 0; i < args.size(); i++) {
+            auto var = static_cast<VarExpr*>(args[i]);
+            copied[i] = protos.make<VarExpr>(var->get_name());
+        }
+        return protos.make<FuncPrototype>(
+                proto->get_name(), ArenaArray<Expr*>(copied, args.size()));
+    }
+
+    // same checks as CodeGen::codegen(FuncPrototype*)
+    TierFunction* declare(FuncPrototype* proto) {
+        SymbolId name = proto->get_name();
+        if (TierFunction* fn = find(name)) {
+            if (fn->proto->get_args().size() != proto->get_args().size()) {
+                return log_error_v("redeclaration with a different number "
+                                   "of arguments");
+            }
+            return fn;
+        }
+        if (name >= functions.size()) {
+            functions.resize(name + 1);
+        }
+        functions[name].proto = copy_proto(proto);
+        return &functions[name];
+    }
+
+    // copies a body into fn.body in post-order
+    ExprId lower(TierFunction& fn, Expr* root) {
+        work.clear();
+        ids.clear();
+        work.push_back(Pending{root, false});
+
+        while (!work.empty()) {
+            Expr* e = work.back().e;
+            bool expanded = work.back().expanded;
+            switch (e->get_kind()) {
+                case ExprKind::Num:
+                    ids.push_back(fn.body.num(
+                            static_cast<NumExpr*>(e)->get_val()));
+                    break;
+
+                case ExprKind::Var:
+                    ids.push_back(fn.body.var(
+                            static_cast<VarExpr*>(e)->get_name()));
+                    break;
+
+                case ExprKind::Binary: {
+                    auto bin = static_cast<BinaryExpr*>(e);
+                    if (!expanded) {
+                        work.back().expanded = true;
+                        work.push_back(Pending{bin->get_rhs(), false});
+                        work.push_back(Pending{bin->get_lhs(), false});
+                        continue;
+                    }
+                    ExprId rhs = ids.back();
+                    ids.pop_back();
+                    ids.back() = fn.body.binary(bin->get_op(), ids.back(), rhs);
+                    break;
+                }
+
+                case ExprKind::Call: {
+                    auto call = static_cast<CallExpr*>(e);
+                    const ArenaArray<Expr*>& args = call->get_args();
+                    if (!expanded) {
+                        work.back().expanded = true;
+                        for (uint32_t i = args.size(); i-- > 0;) {
+                            work.push_back(Pending{args[i], false});
+                        }
+                        continue;
+                    }
+                    size_t first = ids.size() - args.size();
+                    ExprId id = fn.body.call(call->get_callee(),
+                                             ids.data() + first, args.size());
+                    ids.resize(first);
+                    ids.push_back(id);
+                    break;
+                }
+
+                case ExprKind::Function:
+                    return log_error<ExprId>("function used as an expression");
+            }
+            work.pop_back();
+        }
+
+        return ids.back();
+    }
+
+    // the nodes of a flat body are copied as they are
+    ExprId lower(TierFunction& fn, const FlatFunction& src) {
+        const FlatExprPool& pool = *src.pool;
+        uint32_t base = src.first.index;
+        ids.resize(src.body.index - base + 1);
+        for (uint32_t i = base; i <= src.body.index; i++) {
+            ExprId id{i};
+            switch (pool.kind(id)) {
+                case FlatKind::Num:
+                    ids[i - base] = fn.body.num(pool.literal(id));
+                    break;
+                case FlatKind::Var:
+                    ids[i - base] = fn.body.var(pool.symbol(id));
+                    break;
+                case FlatKind::Binary:
+                    ids[i - base] = fn.body.binary(
+                            pool.op(id), ids[pool.lhs(id).index - base],
+                            ids[pool.rhs(id).index - base]);
+                    break;
+                case FlatKind::Call: {
+                    uint32_t n = pool.arg_count(id);
+                    size_t first = ids.size();
+                    for (uint32_t a = 0; a < n; a++) {
+                        ids.push_back(ids[pool.arg(id, a).index - base]);
+                    }
+                    ids[i - base] = fn.body.call(pool.symbol(id),
+                                                 ids.data() + first, n);
+                    ids.resize(first);
+                    break;
+                }
+            }
+        }
+        return ids[src.body.index - base];
+    }
+
+    template <typename R>
+    static R log_error(const char* str) {
+        log_error_v(str);
+        return R();
+    }
+
+    llvm::StringRef name_of(SymbolId id) const {
+        std::string_view name = symbols.name(id);
+        return llvm::StringRef(name.data(), name.size());
+    }
+
+    // the profile's counters and threshold for fn, a definition. compiled
+    // code counts its own calls, these are for the interpreted ones.
+    void profile(TierFunction& fn) {
+        SymbolId name = fn.proto->get_name();
+        uint64_t calls;
+        bool hot = ProfileUse
+                && ProfileUse->function_calls(name_of(name), calls)
+                && ProfileUse->is_hot(calls);
+        fn.tier_up = hot ? 1 : TierUpCalls;
+        if (!ProfileGenerate) {
+            return;
+        }
+        fn.counter = ProfileGenerate->function_counter(name_of(name));
+        fn.edge_counters.assign(fn.body.size(), nullptr);
+        for (uint32_t i = 0; i < fn.body.size(); i++) {
+            if (fn.body.kind(ExprId{i}) == FlatKind::Call) {
+                fn.edge_counters[i] = ProfileGenerate->edge_counter(
+                        name_of(name), name_of(fn.body.symbol(ExprId{i})));
+            }
+        }
+    }
+
+    // resolves the arguments of fn's body to slots and reports what
+    // CodeGen would: unknown names, operators and argument counts. the
+    // callees end up in body_calls.
+    bool check(TierFunction& fn) {
+        const ArenaArray<Expr*>& params = fn.proto->get_args();
+        fn.slots.assign(fn.body.size(), 0);
+        body_calls.clear();
+
+        for (uint32_t i = 0; i < fn.body.size(); i++) {
+            ExprId id{i};
+            switch (fn.body.kind(id)) {
+                case FlatKind::Num:
+                    break;
+                case FlatKind::Var: {
+                    uint32_t slot = 0;
+                    while (slot < params.size()
+                            && static_cast<VarExpr*>(params[slot])->get_name()
+                                    != fn.body.symbol(id)) {
+                        slot++;
+                    }
+                    if (slot == params.size()) {
+                        return log_error<bool>("unknown variable name");
+                    }
+                    fn.slots[i] = slot;
+                    break;
+                }
+                case FlatKind::Binary:
+                    if (!strchr("+-*/<", fn.body.op(id))) {
+                        return log_error<bool>("invalid binary operator");
+                    }
+                    break;
+                case FlatKind::Call: {
+                    // a recursive call goes by the prototype being defined,
+                    // which needn't be in functions yet or may be replacing
+                    // one with a different number of arguments
+                    SymbolId callee = fn.body.symbol(id);
+                    FuncPrototype* proto = nullptr;
+                    if (callee == fn.proto->get_name()
+                            && callee != sym_anon_expr) {
+                        proto = fn.proto;
+                    } else if (TierFunction* known = find(callee)) {
+                        proto = known->proto;
+                    }
+                    if (!proto) {
+                        return log_error<bool>("unknown function referenced");
+                    }
+                    if (proto->get_args().size() != fn.body.arg_count(id)) {
+                        return log_error<bool>(
+                                "incorrect number of arguments passed");
+                    }
+                    body_calls.push_back(callee);
+                    break;
+                }
+            }
+        }
+        return true;
+    }
+
+    // all functions fn can end up calling that have no body in the jit yet
+    // are emitted into one module, together with the adapter of fn, and
+    // added lazily. compiled code only ever calls compiled code, and
+    // nothing is compiled before it is called.
+    bool compile(SymbolId id) {
+        reachable.clear();
+        seen.assign(functions.size(), false);
+        reachable.push_back(id);
+        seen[id] = true;
+        for (size_t r = 0; r < reachable.size(); r++) {
+            TierFunction& fn = functions[reachable[r]];
+            if (fn.in_jit) {
+                continue;
+            }
+            for (uint32_t i = 0; i < fn.body.size(); i++) {
+                ExprId node{i};
+                if (fn.body.kind(node) == FlatKind::Call
+                        && !seen[fn.body.symbol(node)]) {
+                    seen[fn.body.symbol(node)] = true;
+                    reachable.push_back(fn.body.symbol(node));
+                }
+            }
+        }
+
+        // externs have to be found in the process before anything is
+        // compiled, after that a missing one would only turn up as a
+        // failing lazy compile
+        for (SymbolId r : reachable) {
+            if (!functions[r].root
+                    && !jit.lookup(std::string(symbols.name(r)))) {
+                return false;
+            }
+        }
+
+        // the module is dropped if anything fails, which shouldn't happen
+        // for bodies that passed check()
+        for (SymbolId r : reachable) {
+            if (!cg.codegen(functions[r].proto)) {
+                cg.take_module("tier");
+                return false;
+            }
+        }
+        for (SymbolId r : reachable) {
+            TierFunction& fn = functions[r];
+            if (!fn.in_jit) {
+                if (!cg.codegen(FlatFunction{fn.proto, &fn.body, fn.root,
+                                             ExprId{0}})) {
+                    cg.take_module("tier");
+                    return false;
+                }
+                fn.in_jit = true;
+            }
+        }
+        if (!emit_adapter(id)) {
+            cg.take_module("tier");
+            return false;
+        }
+        if (!jit.add_definitions(cg.take_module("tier"), cg.get_context())) {
+            return false;
+        }
+        return bind_native(id);
+    }
+
+    // emits the adapter of id for its current number of arguments, unless
+    // the jit has one from before
+    bool emit_adapter(SymbolId id) {
+        TierFunction& fn = functions[id];
+        uint32_t n = fn.proto->get_args().size();
+        if (std::find(fn.adapters.begin(), fn.adapters.end(), n)
+                != fn.adapters.end()) {
+            return true;
+        }
+        if (!cg.codegen_adapter(id)) {
+            return false;
+        }
+        fn.adapters.push_back(n);
+        return true;
+    }
+
+    bool bind_native(SymbolId id) {
+        TierFunction& fn = functions[id];
+        fn.native = reinterpret_cast<NativeFn>(jit.lookup(
+                cg.adapter_name(id, fn.proto->get_args().size())));
+        return fn.native != nullptr;
+    }
+
+    double call(SymbolId id, size_t args_at) {
+        TierFunction& fn = functions[id];
+        if (!fn.native && !fn.failed
+                && (!fn.root || ++fn.calls >= fn.tier_up)) {
+            if (fn.root) {
+                std::string_view name = symbols.name(id);
+                stderr_output().note("compiling %.*s after %u calls",
+                        static_cast<int>(name.size()), name.data(), fn.calls);
+            }
+            fn.failed = !compile(id);
+        }
+        if (fn.native) {
+            return fn.native(stack.data() + args_at);
+        }
+        if (!fn.root) {
+            faulted = true;
+            return 0;
+        }
+        if (fn.counter) {
+            ++*fn.counter;
+        }
+        return interpret(fn, args_at);
+    }
+
+    double interpret(const TierFunction& fn, size_t args_at) {
+        size_t base = stack.size();
+        stack.resize(base + fn.body.size());
+
+        for (uint32_t i = 0; i <= fn.root.index; i++) {
+            ExprId id{i};
+            double v = 0;
+            switch (fn.body.kind(id)) {
+                case FlatKind::Num:
+                    v = fn.body.literal(id);
+                    break;
+                case FlatKind::Var:
+                    v = stack[args_at + fn.slots[i]];
+                    break;
+                case FlatKind::Binary: {
+                    double lhs = stack[base + fn.body.lhs(id).index];
+                    double rhs = stack[base + fn.body.rhs(id).index];
+                    switch (fn.body.op(id)) {
+                        case '+': v = lhs + rhs; break;
+                        case '-': v = lhs - rhs; break;
+                        case '*': v = lhs * rhs; break;
+                        case '/': v = lhs / rhs; break;
+                        // unordered or less than, like the compiled code
+                        case '<': v = !(lhs >= rhs); break;
+                    }
+                    break;
+                }
+                case FlatKind::Call: {
+                    // the callee's arguments go on top of this frame
+                    uint32_t n = fn.body.arg_count(id);
+                    size_t at = stack.size();
+                    for (uint32_t a = 0; a < n; a++) {
+                        stack.push_back(
+                                stack[base + fn.body.arg(id, a).index]);
+                    }
+                    if (!fn.edge_counters.empty()) {
+                        ++*fn.edge_counters[i];
+                    }
+                    v = call(fn.body.symbol(id), at);
+                    stack.resize(at);
+                    break;
+                }
+            }
+            stack[base + i] = v;
+        }
+
+        double result = stack[base + fn.root.index];
+        stack.resize(base);
+        return result;
+    }
+
+    // the body is lowered into pending first, so a redefinition that
+    // fails leaves the function as it was. a redefinition of a function
+    // the jit has is emitted again right away, which repoints its stub for
+    // the compiled code calling it. the number of arguments can only change
+    // while nothing else calls the function.
+    template <typename F>
+    bool define(FuncPrototype* proto, F lower_body) {
+        SymbolId name = proto->get_name();
+        TierFunction* fn = find(name);
+        bool redefining = fn && fn->root;
+        if (fn && !fn->root && fn->native) {
+            // an extern can still be defined as long as nothing has called it
+            return log_error<bool>("function cannot be redefined");
+        }
+        if (fn && fn->proto->get_args().size() != proto->get_args().size()) {
+            if (!redefining) {
+                return log_error<bool>("redeclaration with a different number "
+                                       "of arguments");
+            }
+            if (graph.has_other_callers(name)) {
+                return log_error<bool>("redefinition changes the number of "
+                                       "arguments of a function still called "
+                                       "elsewhere");
+            }
+        }
+
+        pending.proto = proto;
+        pending.body.clear();
+        pending.root = lower_body(pending);
+        if (!pending.root || !check(pending)) {
+            return false;
+        }
+        graph.set_callees(name, body_calls);
+
+        if (!fn) {
+            fn = declare(proto);
+        } else {
+            fn->proto = copy_proto(proto);
+        }
+        std::swap(fn->body, pending.body);
+        std::swap(fn->slots, pending.slots);
+        fn->root = pending.root;
+        profile(*fn);
+
+        if (!redefining) {
+            fn->in_jit = false;
+        } else if (fn->in_jit) {
+            if (!cg.codegen(FlatFunction{fn->proto, &fn->body, fn->root,
+                                         ExprId{0}})
+                    || (fn->native && !emit_adapter(name))
+                    || !jit.add_definitions(cg.take_module("tier"),
+                                            cg.get_context())
+                    || (fn->native && !bind_native(name))) {
+                // compiled callers keep the old version
+                cg.take_module("tier");
+                fn->native = nullptr;
+                fn->failed = true;
+            }
+        }
+        return true;
+    }
+
+    template <typename F>
+    bool evaluate(FuncPrototype* proto, F lower_body, double& result) {
+        anon.proto = proto;
+        anon.body.clear();
+        anon.root = lower_body(anon);
+        if (!anon.root || !check(anon)) {
+            return false;
+        }
+        faulted = false;
+        PhaseScope scope(Phase::Execute);
+        result = interpret(anon, stack.size());
+        return !faulted;
+    }
+
+public:
+    Interpreter(const SymbolTable& symbols, CodeGen& cg, Jit& jit)
+        : symbols(symbols), cg(cg), jit(jit) {}
+
+    bool define_extern(FuncPrototype* proto) {
+        TierFunction* fn = declare(proto);
+        if (!fn) {
+            return false;
+        }
+        // nothing to emit, the jit finds it in the process
+        if (!fn->root) {
+            fn->in_jit = true;
+        }
+        return true;
+    }
+
+    // for what a Parser<B>::Func holds, whichever the builder
+    bool define(Expr* e) {
+        auto fn = static_cast<FunctionExpr*>(e);
+        return define(fn->get_proto(), [&](TierFunction& tf) {
+            return lower(tf, fn->get_body());
+        });
+    }
+    bool define(const FlatFunction& fn) {
+        return define(fn.proto, [&](TierFunction& tf) {
+            return lower(tf, fn);
+        });
+    }
+
+    bool evaluate(Expr* e, double& result) {
+        auto fn = static_cast<FunctionExpr*>(e);
+        return evaluate(fn->get_proto(), [&](TierFunction& tf) {
+            return lower(tf, fn->get_body());
+        }, result);
+    }
+    bool evaluate(const FlatFunction& fn, double& result) {
+        return evaluate(fn.proto, [&](TierFunction& tf) {
+            return lower(tf, fn);
+        }, result);
+    }
+};
+
+
+/////////////////
+/* THREAD POOL */
+/////////////////
+
+// fixed set of workers running queued tasks in the order they were submitted
+class ThreadPool {
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable has_work;
+    std::condition_variable all_done;
+    size_t unfinished = 0;
+    bool stopping = false;
+
+    void work() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                has_work.wait(lock, [&] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+
+            task();
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--unfinished == 0) {
+                all_done.notify_all();
+            }
+        }
+    }
+
+public:
+    explicit ThreadPool(unsigned threads) {
+        for (unsigned i = 0; i < std::max(threads, 1u); i++) {
+            workers.emplace_back([this] {
+                ThreadTraceScope trace;
+                work();
+            });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        has_work.notify_all();
+        for (std::thread& t : workers) {
+            t.join();
+        }
+    }
+
+    unsigned size() const { return workers.size(); }
+
+    void submit(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(task));
+            ++unfinished;
+        }
+        has_work.notify_one();
+    }
+
+    // blocks until every task submitted so far has finished
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        all_done.wait(lock, [&] { return unfinished == 0; });
+    }
+};
+
+// runs task(i) for every i in [0, n) on up to threads threads, the calling
+// one included. each thread starts with a contiguous share of the indices
+// and works through it front to back. a thread that runs out steals from
+// the back of another's share, so uneven tasks still keep everyone busy.
+static void parallel_for_stealing(size_t n, unsigned threads,
+                                  const std::function<void(size_t)>& task) {
+    threads = std::max(1u, std::min<unsigned>(threads, n));
+
+    struct Share {
+        std::mutex mutex;
+        size_t next = 0;
+        size_t end = 0;
+    };
+    std::vector<Share> shares(threads);
+    for (unsigned w = 0; w < threads; w++) {
+        shares[w].next = n * w / threads;
+        shares[w].end = n * (w + 1) / threads;
+    }
+
+    auto work = [&](unsigned self) {
+        while (true) {
+            size_t index = n;
+            {
+                Share& own = shares[self];
+                std::lock_guard<std::mutex> lock(own.mutex);
+                if (own.next < own.end) {
+                    index = own.next++;
+                }
+            }
+            for (unsigned i = 1; index == n && i < threads; i++) {
+                Share& victim = shares[(self + i) % threads];
+                std::lock_guard<std::mutex> lock(victim.mutex);
+                if (victim.next < victim.end) {
+                    index = --victim.end;
+                }
+            }
+            // nothing left anywhere, and tasks never add more
+            if (index == n) {
+                return;
+            }
+            task(index);
+        }
+    };
+
+    std::vector<std::thread> helpers;
+    for (unsigned w = 1; w < threads; w++) {
+        helpers.emplace_back([&work, w] {
+            ThreadTraceScope trace;
+            work(w);
+        });
+    }
+    work(0);
+    for (std::thread& t : helpers) {
+        t.join();
+    }
+}
+
+static unsigned default_jobs() {
+    unsigned n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+}
+
+
+////////////////
+/* BATCH EVAL */
+////////////////
+
+// runs one definition over many rows of arguments at once, given as a
+// column (const double*) per argument and an output buffer. the jit gets a
+// copy of the definition made private and always inlined, and a loop
+// calling it over a range of rows (see CodeGen::codegen_batch()). the two
+// go through the module pipeline for the host, so the loop vectorizer
+// widens the loop to as many doubles as the cpu's vectors hold. a call to
+// another function stays a scalar call through its stub and keeps the loop
+// scalar, as does -O0. large batches are split across threads.
+
+// rows a thread takes at a time
+static constexpr size_t BatchChunkRows = 16 * 1024;
+
+class BatchKernel {
+    using BatchFn = void (*)(const double* const*, double*, int64_t, int64_t);
+
+    Jit& jit;
+    CodeGen& cg;
+    std::string name;
+    uint32_t arity = 0;
+    // doubles per vector in the loop, 0 if it didn't vectorize
+    uint32_t lanes = 0;
+    llvm::orc::ResourceTrackerSP tracker;
+    BatchFn fn = nullptr;
+
+    void drop() {
+        if (tracker) {
+            jit.remove(tracker);
+        }
+        tracker = nullptr;
+        fn = nullptr;
+    }
+
+public:
+    BatchKernel(Jit& jit, CodeGen& cg, std::string name)
+        : jit(jit), cg(cg), name(std::move(name)) {}
+    ~BatchKernel() { drop(); }
+
+    BatchKernel(const BatchKernel&) = delete;
+    BatchKernel& operator=(const BatchKernel&) = delete;
+
+    const std::string& get_name() const { return name; }
+    uint32_t get_arity() const { return arity; }
+    uint32_t get_lanes() const { return lanes; }
+    bool ready() const { return fn; }
+
+    // builds the kernel from def, a definition of name just generated into
+    // a module of cg's that has not gone to the jit yet. replaces the
+    // kernel of an earlier definition.
+    bool build(const llvm::Function& def) {
+        drop();
+        auto module = llvm::CloneModule(*def.getParent());
+        module->setModuleIdentifier(name + ".batch");
+        module->setTargetTriple(
+                jit.get_target_machine()->getTargetTriple().str());
+        llvm::Function* kernel = module->getFunction(def.getName());
+        // whatever else is defined there is called through its stub
+        for (llvm::Function& f : *module) {
+            if (&f != kernel && !f.isDeclaration()) {
+                f.deleteBody();
+            }
+        }
+        kernel->setName(name + ".kernel");
+        kernel->setLinkage(llvm::Function::PrivateLinkage);
+        kernel->addFnAttr(llvm::Attribute::AlwaysInline);
+
+        llvm::Function* loop = cg.codegen_batch(kernel, name);
+        if (!loop) {
+            return false;
+        }
+        Optimizer(OptLevel, jit.get_target_machine()).optimize_module(*module);
+
+        lanes = 0;
+        for (const llvm::BasicBlock& bb : *loop) {
+            for (const llvm::Instruction& inst : bb) {
+                if (auto vec = llvm::dyn_cast<llvm::FixedVectorType>(
+                        inst.getType())) {
+                    lanes = std::max(lanes, vec->getNumElements());
+                }
+            }
+        }
+        arity = def.arg_size();
+
+        tracker = jit.add_module(std::move(module), cg.get_context());
+        if (!tracker) {
+            return false;
+        }
+        fn = reinterpret_cast<BatchFn>(jit.lookup(name + ".batch"));
+        return fn;
+    }
+
+    // out[i] = name(cols[0][i], ..., cols[arity - 1][i]) for every row i
+    // in [0, rows), on up to jobs threads. the first chunk runs on the
+    // calling thread alone: with no control flow in the language it calls
+    // every function the kernel can reach, so the lazy compiles are all
+    // done before the other threads start.
+    void run(const double* const* cols, double* out, size_t rows,
+             unsigned jobs) {
+        PhaseScope scope(Phase::Execute);
+        size_t first = std::min(rows, BatchChunkRows);
+        if (first) {
+            fn(cols, out, 0, first);
+        }
+        size_t chunks = (rows - first + BatchChunkRows - 1) / BatchChunkRows;
+        parallel_for_stealing(chunks, jobs, [&](size_t c) {
+            size_t begin = first + c * BatchChunkRows;
+            fn(cols, out, begin, std::min(rows, begin + BatchChunkRows));
+        });
+    }
+};
+
+// --batch=<fn>: stdin has a row of arguments per line, whitespace
+// separated, and stdout gets a result per row
+static bool batch_eval_stdin(BatchKernel& kernel, unsigned jobs) {
+    std::string input;
+    char buffer[64 * 1024];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), stdin)) > 0) {
+        input.append(buffer, n);
+    }
+
+    uint32_t arity = kernel.get_arity();
+    std::vector<std::vector<double>> columns(arity);
+    size_t rows = 0;
+    const char* p = input.c_str();
+    const char* end = p + input.size();
+    while (p < end) {
+        const char* eol = static_cast<const char*>(
+                memchr(p, '\n', end - p));
+        if (!eol) {
+            eol = end;
+        }
+        uint32_t values = 0;
+        while (true) {
+            char* next;
+            double v = strtod(p, &next);
+            if (next == p || next > eol) {
+                break;
+            }
+            if (values < arity) {
+                columns[values].push_back(v);
+            }
+            ++values;
+            p = next;
+        }
+        while (p < eol && isspace(*p)) {
+            p++;
+        }
+        // blank lines are skipped
+        if (p == eol && values == 0) {
+            p = eol + 1;
+            continue;
+        }
+        if (p != eol || values != arity) {
+            stderr_output().error("row %zu does not have the %u arguments "
+                    "of %s", rows + 1, arity, kernel.get_name().c_str());
+            return false;
+        }
+        ++rows;
+        p = eol + 1;
+    }
+
+    std::vector<const double*> cols(arity);
+    for (uint32_t a = 0; a < arity; a++) {
+        cols[a] = columns[a].data();
+    }
+    std::vector<double> out(rows);
+    kernel.run(cols.data(), out.data(), rows, jobs);
+
+    for (double v : out) {
+        printf("%.17g\n", v);
+    }
+    if (kernel.get_lanes()) {
+        stderr_output().note("evaluated %s over %zu rows, vectorized %u wide",
+                             kernel.get_name().c_str(), rows,
+                             kernel.get_lanes());
+    } else {
+        stderr_output().note("evaluated %s over %zu rows, not vectorized",
+                             kernel.get_name().c_str(), rows);
+    }
+    return true;
+}
+
+
+////////////////////
+// top level parsing
+////////////////////
+
+// each handler drops the whole item's AST in one go when it is done with it
+
+// where the repl sends what it parses. with a jit each definition goes into
+// a module of its own, which the jit optimizes and compiles on the first
+// call. externs stay in the module being built and are handed over with the
+// next definition or expression. without one the IR is optimized right
+// away, so what is printed is what would run. with an interpreter (which
+// needs the jit) items are run on it and nothing is printed but results.
+// with a batch kernel (which needs the jit too) each definition of its
+// function rebuilds it. the jit's library is lib, the main one if null,
+// and what the repl reports goes to out, parse errors as positions in
+// source.
+struct Repl {
+    CodeGen& cg;
+    Optimizer& opt;
+    Jit* jit = nullptr;
+    Interpreter* interp = nullptr;
+    BatchKernel* batch = nullptr;
+    Jit::Library* lib = nullptr;
+    DiagnosticEngine& out = stderr_output();
+    const char* source = "<stdin>";
+};
+
+// reports why an item did not parse and skips past it
+template <typename B>
+static void item_failed(Parser<B>& p, Repl& r) {
+    p.flush_diagnostics(r.source, r.out);
+    p.recover();
+}
+
+// a note, so --quiet skips printing it at all
+static void print_ir(const llvm::Function& fn, DiagnosticEngine& out) {
+    if (out.wants(Severity::Note)) {
+        DiagnosticStream os(out);
+        fn.print(os);
+    }
+}
+
+// off when stdout is for something else, see --batch
+static bool ReplPrompt = true;
+
+template <typename B>
+static void handle_definition(Parser<B>& p, Repl& r) {
+    if (auto fn = p.parse_definition()) {
+        if (r.interp) {
+            if (r.interp->define(fn)) {
+                r.out.note("read function definition");
+            }
+        } else if (auto ir = r.cg.codegen_function(fn)) {
+            if (!r.jit) {
+                r.opt.optimize_function(*ir);
+            }
+            r.out.note("read function definition:");
+            print_ir(*ir, r.out);
+            if (r.batch && ir->getName() == r.batch->get_name()) {
+                r.batch->build(*ir);
+            }
+            if (r.jit) {
+                r.jit->add_definitions(r.cg.take_module("repl"),
+                                       r.cg.get_context(), r.lib);
+            }
+        }
+    } else {
+        item_failed(p, r);
+    }
+    p.reset_ast();
+}
+
+template <typename B>
+static void handle_toplevel_expr(Parser<B>& p, Repl& r) {
+    if (auto fn = p.parse_toplevel_expr()) {
+        r.out.note("parsed top level expression");
+        double result;
+        if (r.interp) {
+            if (r.interp->evaluate(fn, result)) {
+                r.out.print("evaluated to %f\n", result);
+            }
+        } else if (auto ir = r.cg.codegen_function(fn)) {
+            if (!r.jit) {
+                r.opt.optimize_function(*ir);
+            }
+            print_ir(*ir, r.out);
+            if (!r.jit) {
+                // nothing can call it, so don't let it pile up in the module
+                r.cg.erase(ir);
+            } else if (r.jit->run(r.cg.take_module("repl"), r.cg.get_context(),
+                                  "__anon_expr", result, r.lib)) {
+                r.out.print("evaluated to %f\n", result);
+            }
+        }
+    } else {
+        item_failed(p, r);
+    }
+    p.reset_ast();
+}
+
+template <typename B>
+static void handle_extern(Parser<B>& p, Repl& r) {
+    if (auto proto = p.parse_extern()) {
+        r.out.note("parsed extern");
+        if (r.interp) {
+            r.interp->define_extern(proto);
+        } else if (auto ir = r.cg.codegen(proto)) {
+            print_ir(*ir, r.out);
+        }
+    } else {
+        item_failed(p, r);
+    }
+    p.reset_ast();
+}
+
+
+template <typename B>
+static void main_loop(Parser<B>& p, Repl& r) {
+    if (ReplPrompt) {
+        printf("ready> ");
+    }
+    p.get_next_token();
+    while (true) {
+        switch (p.current()) {
+            case tok_eof:
+                stats_add_nodes(p.nodes());
+                return;
+
+            // an item ends at its ';', which is eaten here rather than
+            // being the token reading the next one so a 'def' or 'extern'
+            // right after an item still starts one
+            case ';':
+                if (ReplPrompt) {
+                    printf("ready> ");
+                }
+                p.get_next_token(); // eat the ';'
+                break;
+
+            case tok_def:
+                handle_definition(p, r);
+                break;
+
+            case tok_extern:
+                handle_extern(p, r);
+                break;
+
+            default:
+                handle_toplevel_expr(p, r);
+                break;
+        }
+    }
+}
+
+// the repl with expressions built by B, which is made from store
+template <typename B, typename Store>
+static void run_repl(TokenStream& toks, Store& store, AstContext& ctx,
+                     Repl& r) {
+    B builder(store);
+    Parser<B> parser(toks, builder, ctx);
+    main_loop(parser, r);
+}
+
+////////////
+/* SERVER */
+////////////
+
+// --serve=<socket> runs one process for many clients. each connection to
+// the unix socket is a session with the symbols, ASTs, codegen state and
+// jit library of a repl of its own. the file the server is started with is
+// run first, into the jit's main library: a prelude every session sees
+// behind its own definitions and none can change, a session defining one
+// of its names only shadows it for itself. the prelude's code is compiled
+// once, on the first call from any session.
+//
+// a client sends lines of source and gets back what the repl reports for
+// each line, then a "ready> " prompt. the lines of a session run in order,
+// one at a time, but any number of sessions run at once on a fixed pool
+// of threads. parse, codegen and jit errors all go back to the client,
+// parse errors as positions in the line; the server's stderr only gets its
+// own diagnostics. a session whose client sends more than max_line bytes without
+// a newline is told so and dropped.
+
+static volatile sig_atomic_t ServerStopping = 0;
+
+static void server_stop(int) { ServerStopping = 1; }
+
+class Server {
+    struct Session {
+        Server& server;
+        int fd;
+        SymbolTable symbols;
+        ThreadCodegenState codegen;
+        CodeGen cg;
+        AstContext ctx;
+        FlatExprPool pool;
+        std::unique_ptr<Jit::Library> lib;
+
+        // lines waiting to run, and whether a task of the pool is on them
+        std::mutex mutex;
+        std::deque<std::string> lines;
+        bool running = false;
+        // the end of what was received, short of a newline. only touched
+        // by the polling thread.
+        std::string partial;
+
+        Session(Server& server, int fd, std::unique_ptr<Jit::Library> lib)
+            : server(server),
+              fd(fd),
+              cg(symbols, "session", codegen),
+              lib(std::move(lib)) {
+            cg.set_data_layout(server.jit.get_data_layout());
+            // everything the prelude declared can be called
+            for (SymbolId id = 0; id < server.prelude_symbols.size(); id++) {
+                int32_t arity = server.prelude.known_arity(id);
+                if (arity >= 0) {
+                    cg.declare_known(
+                            symbols.intern(server.prelude_symbols.name(id)),
+                            arity);
+                }
+            }
+        }
+
+        ~Session() {
+            server.recycle(std::move(lib));
+            close(fd);
+        }
+    };
+
+    Jit& jit;
+    // what ran the prelude, only read once sessions start
+    const CodeGen& prelude;
+    const SymbolTable& prelude_symbols;
+    Optimizer& opt;
+    bool flat;
+
+    // libraries of sessions that have ended, cleared for the next ones
+    std::mutex free_mutex;
+    std::vector<std::unique_ptr<Jit::Library>> free_libraries;
+    uint32_t libraries = 0;
+
+    // longest line a session may send, so one client can't grow the
+    // server without bound
+    static constexpr size_t max_line = 1 << 20;
+
+    uint64_t sessions = 0;
+    std::atomic<uint64_t> lines_run{0};
+
+    // last, so the workers are done before the rest goes
+    ThreadPool workers;
+
+    static void send_all(int fd, const char* data, size_t size) {
+        while (size > 0) {
+            ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            // the client is gone, its session ends with the next poll
+            if (n <= 0) {
+                return;
+            }
+            data += n;
+            size -= n;
+        }
+    }
+
+    std::unique_ptr<Jit::Library> acquire() {
+        {
+            std::lock_guard<std::mutex> lock(free_mutex);
+            if (!free_libraries.empty()) {
+                auto lib = std::move(free_libraries.back());
+                free_libraries.pop_back();
+                return lib;
+            }
+        }
+        return jit.create_library("session." + std::to_string(libraries++));
+    }
+
+    void recycle(std::unique_ptr<Jit::Library> lib) {
+        if (!lib || !jit.clear_library(*lib)) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(free_mutex);
+        free_libraries.push_back(std::move(lib));
+    }
+
+    // runs one line of s as the repl would, on a worker
+    void run_line(Session& s, std::string line) {
+        char* text = nullptr;
+        size_t size = 0;
+        FILE* out = open_memstream(&text, &size);
+        if (!out) {
+            return;
+        }
+        {
+            DiagnosticEngine engine(out);
+            // errors of codegen and the jit are the client's too
+            Jit::DiagnosticsScope scope(engine);
+            s.cg.set_diagnostics(engine);
+            MemorySource src(std::move(line));
+            Lexer lex(src, s.symbols);
+            TokenStream toks(lex);
+            Repl r{s.cg, opt, &jit, nullptr, nullptr, s.lib.get(), engine,
+                   "<line>"};
+            if (flat) {
+                with_builder<FlatBuilder>([&](auto tag) {
+                    using B = typename decltype(tag)::type;
+                    run_repl<B>(toks, s.pool, s.ctx, r);
+                });
+            } else {
+                with_builder<TreeBuilder>([&](auto tag) {
+                    using B = typename decltype(tag)::type;
+                    run_repl<B>(toks, s.ctx, s.ctx, r);
+                });
+            }
+            s.cg.set_diagnostics(stderr_output());
+        }
+        // the engine has written everything out by now
+        fputs("ready> ", out);
+        fclose(out);
+        send_all(s.fd, text, size);
+        free(text);
+        ++lines_run;
+        // the server's own log, so it shows up while the server runs
+        stderr_output().flush();
+    }
+
+    // runs the lines of s until there are none left
+    void drain(Session& s) {
+        while (true) {
+            std::string line;
+            {
+                std::lock_guard<std::mutex> lock(s.mutex);
+                if (s.lines.empty()) {
+                    s.running = false;
+                    return;
+                }
+                line = std::move(s.lines.front());
+                s.lines.pop_front();
+            }
+            run_line(s, std::move(line));
+        }
+    }
+
+    // false if s sent a line longer than max_line, and is to be dropped
+    bool receive(const std::shared_ptr<Session>& s, const char* data,
+                 size_t size) {
+        s->partial.append(data, size);
+        size_t begin = 0;
+        size_t eol;
+        std::lock_guard<std::mutex> lock(s->mutex);
+        while ((eol = s->partial.find('\n', begin)) != std::string::npos) {
+            s->lines.push_back(s->partial.substr(begin, eol + 1 - begin));
+            begin = eol + 1;
+        }
+        s->partial.erase(0, begin);
+        if (!s->running && !s->lines.empty()) {
+            s->running = true;
+            workers.submit([this, s] { drain(*s); });
+        }
+        if (s->partial.size() > max_line) {
+            static const char message[] = "Error: line too long\n";
+            send_all(s->fd, message, sizeof(message) - 1);
+            return false;
+        }
+        return true;
+    }
+
+public:
+    Server(Jit& jit, const CodeGen& prelude,
+           const SymbolTable& prelude_symbols, Optimizer& opt, bool flat,
+           unsigned threads)
+        : jit(jit),
+          prelude(prelude),
+          prelude_symbols(prelude_symbols),
+          opt(opt),
+          flat(flat),
+          workers(threads) {}
+
+    // serves the socket at path until SIGINT or SIGTERM
+    bool serve(const char* path) {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+            stderr_output().error("socket path %s is too long", path);
+            return false;
+        }
+        strcpy(addr.sun_path, path);
+
+        // a socket left behind by an earlier server, never anything else
+        struct stat st;
+        if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+            unlink(path);
+        }
+
+        int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listener < 0
+                || bind(listener, reinterpret_cast<sockaddr*>(&addr),
+                        sizeof(addr)) != 0
+                || listen(listener, 64) != 0) {
+            stderr_output().error("could not listen on %s: %s", path,
+                    strerror(errno));
+            if (listener >= 0) {
+                close(listener);
+            }
+            return false;
+        }
+
+        struct sigaction action{};
+        action.sa_handler = server_stop;
+        // no SA_RESTART, so poll() returns to see the flag
+        sigaction(SIGINT, &action, nullptr);
+        sigaction(SIGTERM, &action, nullptr);
+        stderr_output().note("serving %s on %u threads", path, workers.size());
+        stderr_output().flush();
+
+        // fds[0] is the listener, fds[i] belongs to open[i - 1]
+        std::vector<pollfd> fds{{listener, POLLIN, 0}};
+        std::vector<std::shared_ptr<Session>> open;
+        char buffer[64 * 1024];
+        while (!ServerStopping) {
+            if (poll(fds.data(), fds.size(), -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                stderr_output().error("poll: %s", strerror(errno));
+                break;
+            }
+
+            for (size_t i = fds.size(); i-- > 1;) {
+                if (!fds[i].revents) {
+                    continue;
+                }
+                ssize_t n = read(fds[i].fd, buffer, sizeof(buffer));
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n > 0 && receive(open[i - 1], buffer, n)) {
+                    continue;
+                }
+                // closed, or dropped: what is still queued runs, then the
+                // session goes
+                fds[i] = fds.back();
+                fds.pop_back();
+                open[i - 1] = std::move(open.back());
+                open.pop_back();
+            }
+
+            if (fds[0].revents & POLLIN) {
+                int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+                if (fd < 0) {
+                    continue;
+                }
+                auto lib = acquire();
+                if (!lib) {
+                    close(fd);
+                    continue;
+                }
+                open.push_back(std::make_shared<Session>(*this, fd,
+                                                         std::move(lib)));
+                fds.push_back(pollfd{fd, POLLIN, 0});
+                ++sessions;
+                send_all(fd, "ready> ", 7);
+            }
+        }
+
+        close(listener);
+        unlink(path);
+        open.clear();
+        workers.wait();
+        stderr_output().note("served %llu sessions, %llu lines",
+                static_cast<unsigned long long>(sessions),
+                static_cast<unsigned long long>(lines_run.load()));
+        return true;
+    }
+};
+
+
+////////////////
+/* BENCHMARKS */
+////////////////
+
+// synthetic corpora for measuring the lexer and parser. run with
+//      parser --bench[=<MB per corpus>]
+
+// xorshift, so the corpora are the same on every run
+class BenchRng {
+    uint64_t state;
+
+public:
+    BenchRng(uint64_t seed) : state(seed) {}
+
+    uint64_t next() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+
+    uint64_t below(uint64_t n) {
+        return next() % n;
+    }
+};
+
+static void bench_ident(BenchRng& rng, std::string& out) {
+    static const char* parts[] = {
+        "alpha", "beta", "gamma", "delta", "value", "count", "index",
+        "total", "offset", "result", "temp", "node", "edge", "weight",
+    };
+    int n = 1 + rng.below(4);
+    for (int i = 0; i < n; i++) {
+        out += parts[rng.below(sizeof(parts) / sizeof(parts[0]))];
+    }
+    out += std::to_string(rng.below(1000));
+}
+
+static void bench_number(BenchRng& rng, std::string& out) {
+    out += std::to_string(rng.below(100000));
+    if (rng.below(2)) {
+        out += '.';
+        out += std::to_string(rng.below(1000000));
+    }
+}
+
+static const char bench_ops[] = "+-*/<";
+
+// long expressions over generated identifiers with a few calls mixed in
+static void gen_idents(BenchRng& rng, std::string& out) {
+    int terms = 8 + rng.below(24);
+    for (int i = 0; i < terms; i++) {
+        if (i) {
+            out += ' ';
+            out += bench_ops[rng.below(5)];
+            out += ' ';
+        }
+        bench_ident(rng, out);
+        if (rng.below(8) == 0) {
+            out += '(';
+            bench_ident(rng, out);
+            out += ", ";
+            bench_ident(rng, out);
+            out += ')';
+        }
+    }
+    out += ";\n";
+}
+
+static void gen_numbers(BenchRng& rng, std::string& out) {
+    int terms = 8 + rng.below(24);
+    for (int i = 0; i < terms; i++) {
+        if (i) {
+            out += bench_ops[rng.below(5)];
+        }
+        bench_number(rng, out);
+    }
+    out += ";\n";
+}
+
+static void bench_nest(BenchRng& rng, std::string& out, int depth) {
+    for (int i = 0; i < depth; i++) {
+        out += "f(x, ";
+    }
+    bench_number(rng, out);
+    for (int i = 0; i < depth; i++) {
+        out += ')';
+    }
+    out += ";\n";
+}
+
+// calls nested a few hundred deep, shallow enough for the recursive parser
+static void gen_nesting(BenchRng& rng, std::string& out) {
+    bench_nest(rng, out, 100 + rng.below(400));
+}
+
+// calls nested 100k deep, which overflows the stack of the recursive parser
+// and is what the explicit stack one is for
+static void gen_deep_nesting(BenchRng& rng, std::string& out) {
+    bench_nest(rng, out, 100000);
+}
+
+static void gen_defs(BenchRng& rng, std::string& out) {
+    out += "def ";
+    bench_ident(rng, out);
+    out += "(a, b) a * b + ";
+    bench_number(rng, out);
+    out += " - b;\n";
+}
+
+static void gen_externs(BenchRng& rng, std::string& out) {
+    out += "extern ";
+    bench_ident(rng, out);
+    out += '(';
+    int n = 4 + rng.below(12);
+    for (int i = 0; i < n; i++) {
+        if (i) {
+            out += ", ";
+        }
+        out += 'a';
+        out += std::to_string(i);
+    }
+    out += ");\n";
+}
+
+struct BenchCorpus {
+    const char* name;
+    void (*gen)(BenchRng&, std::string&);
+    // false if only the explicit stack parser gets through it
+    bool recursive = true;
+};
+
+static const BenchCorpus bench_corpora[] = {
+    {"idents", gen_idents},
+    {"numbers", gen_numbers},
+    {"nesting", gen_nesting},
+    {"deep", gen_deep_nesting, false},
+    {"defs", gen_defs},
+    {"externs", gen_externs},
+};
+
+static std::string bench_generate(const BenchCorpus& corpus, size_t bytes) {
+    BenchRng rng(0x9e3779b97f4a7c15ull);
+    std::string out;
+    out.reserve(bytes + 4096);
+    while (out.size() < bytes) {
+        corpus.gen(rng, out);
+    }
+    return out;
+}
+
+struct BenchResult {
+    double seconds = 0;
+    uint64_t tokens = 0;
+    uint64_t nodes = 0;
+};
+
+static double bench_now() {
+    using clock = std::chrono::steady_clock;
+    return std::chrono::duration<double>(
+            clock::now().time_since_epoch()).count();
+}
+
+static long bench_peak_rss_kb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// every run starts from an empty symbol table, so interning is measured too
+
+static BenchResult bench_lex(InputSource& src) {
+    BenchResult r;
+    double start = bench_now();
+    SymbolTable symbols;
+    Lexer lex(src, symbols);
+    while (lex.next().kind != tok_eof) {
+        ++r.tokens;
+    }
+    r.seconds = bench_now() - start;
+    return r;
+}
+
+// the same dispatch as main_loop() without the output
+template <typename B>
+static void bench_parse_all(Parser<B>& p) {
+    p.get_next_token();
+    while (p.current() != tok_eof) {
+        switch (p.current()) {
+            case ';':
+                p.get_next_token();
+                break;
+            case tok_def:
+                if (!p.parse_definition()) {
+                    p.recover();
+                }
+                break;
+            case tok_extern:
+                if (!p.parse_extern()) {
+                    p.recover();
+                }
+                break;
+            default:
+                if (!p.parse_toplevel_expr()) {
+                    p.recover();
+                }
+                break;
+        }
+        p.reset_ast();
+    }
+}
+
+static BenchResult bench_lex_all(InputSource& src) {
+    BenchResult r;
+    double start = bench_now();
+    SymbolTable symbols;
+    r.tokens = lex_all(src, symbols).size() - 1;
+    r.seconds = bench_now() - start;
+    return r;
+}
+
+static BenchResult bench_parse_tree(InputSource& src,
+                                    TokenFeed feed = TokenFeed::Pull) {
+    BenchResult r;
+    double start = bench_now();
+    SymbolTable symbols;
+    AstContext ctx;
+    TreeBuilder tree(ctx);
+    with_tokens(src, symbols, feed, [&](TokenStream& toks) {
+        Parser<TreeBuilder> p(toks, tree, ctx);
+        bench_parse_all(p);
+        r.nodes = p.nodes();
+    });
+    r.seconds = bench_now() - start;
+    return r;
+}
+
+template <typename B = FlatBuilder>
+static BenchResult bench_parse_flat(InputSource& src) {
+    BenchResult r;
+    double start = bench_now();
+    SymbolTable symbols;
+    Lexer lex(src, symbols);
+    TokenStream toks(lex);
+    AstContext ctx;
+    FlatExprPool pool;
+    B flat(pool);
+    Parser<B> p(toks, flat, ctx);
+    bench_parse_all(p);
+    r.seconds = bench_now() - start;
+    r.nodes = p.nodes();
+    return r;
+}
+
+static void bench_report(const char* corpus, const char* mode, size_t bytes,
+                         const BenchResult& r) {
+    printf("%-8s %-22s %9.1f %10.2f %10.2f %10ld\n", corpus, mode,
+           bytes / r.seconds / 1e6,
+           r.tokens / r.seconds / 1e6,
+           r.nodes / r.seconds / 1e6,
+           bench_peak_rss_kb() / 1024);
+}
+
+// best of a few runs to keep the noise down
+template <typename F>
+static BenchResult bench_best(F run) {
+    BenchResult best;
+    for (int i = 0; i < 3; i++) {
+        BenchResult r = run();
+        if (i == 0 || r.seconds < best.seconds) {
+            best = r;
+        }
+    }
+    return best;
+}
+
+// lex: Lexer::next() to the end of the input
+// lex_all: the same into one token array
+// lex+parse: lexing and parsing. the "parse est" rows take the lexing time
+//     out, since the parser pulls tokens from the lexer as it goes
+// lex|parse queue: the lexer on a thread of its own feeding the parser
+// end to end: mapping a file of the corpus and parsing it
+// corpora too deep for the recursive parser only get the lex and stack rows
+// peak RSS is for the whole process so far, so it only ever goes up
+static int run_benchmarks(size_t bytes) {
+    printf("%-8s %-22s %9s %10s %10s %10s\n", "corpus", "mode", "MB/s",
+           "Mtok/s", "Mnodes/s", "peakRSS MB");
+
+    for (const BenchCorpus& corpus : bench_corpora) {
+        MemorySource src(bench_generate(corpus, bytes));
+        size_t size = src.size();
+
+        BenchResult lex = bench_best([&] { return bench_lex(src); });
+        bench_report(corpus.name, "lex", size, lex);
+        bench_report(corpus.name, "lex_all", size,
+                     bench_best([&] { return bench_lex_all(src); }));
+
+        auto parse_rows = [&](const char* mode, const char* only_mode,
+                              BenchResult r) {
+            r.tokens = lex.tokens;
+            bench_report(corpus.name, mode, size, r);
+            r.seconds -= lex.seconds;
+            if (r.seconds > 0) {
+                bench_report(corpus.name, only_mode, size, r);
+            }
+        };
+
+        if (!corpus.recursive) {
+            ExplicitStackParse = true;
+            parse_rows("lex+parse stack tree", "parse est stack tree",
+                       bench_best([&] { return bench_parse_tree(src); }));
+            ExplicitStackParse = false;
+            continue;
+        }
+
+        ExplicitStackParse = false;
+        parse_rows("lex+parse tree", "parse est tree",
+                   bench_best([&] { return bench_parse_tree(src); }));
+        parse_rows("lex+parse flat", "parse est flat",
+                   bench_best([&] { return bench_parse_flat(src); }));
+        parse_rows("lex+parse flat fold", "parse est flat fold",
+                   bench_best([&] {
+            return bench_parse_flat<FoldingBuilder<FlatBuilder>>(src);
+        }));
+        parse_rows("lex+parse flat hcons", "parse est flat hcons",
+                   bench_best([&] {
+            return bench_parse_flat<HashConsBuilder<FlatBuilder>>(src);
+        }));
+
+        ExplicitStackParse = true;
+        parse_rows("lex+parse stack tree", "parse est stack tree",
+                   bench_best([&] { return bench_parse_tree(src); }));
+        ExplicitStackParse = false;
+
+        BenchResult queued = bench_best([&] {
+            return bench_parse_tree(src, TokenFeed::Queue);
+        });
+        queued.tokens = lex.tokens;
+        bench_report(corpus.name, "lex|parse queue tree", size, queued);
+
+        char path[] = "/tmp/kaleidoscope-bench-XXXXXX";
+        int fd = mkstemp(path);
+        if (fd < 0 || write(fd, src.data(), size) != (ssize_t)size) {
+            stderr_output().error("could not write %s", path);
+            return 1;
+        }
+        close(fd);
+
+        BenchResult e2e = bench_best([&] {
+            double start = bench_now();
+            MappedFileSource file;
+            file.open(path);
+            BenchResult r = bench_parse_tree(file);
+            r.seconds = bench_now() - start;
+            return r;
+        });
+        e2e.tokens = lex.tokens;
+        bench_report(corpus.name, "end to end mmap tree", size, e2e);
+        unlink(path);
+    }
+    return 0;
+}
+
+
+///////////////
+/* AST IMAGE */
+///////////////
+
+// the parsed items of one input file as written to an --ast-cache
+// directory. all of it is at offsets from the start of the file, so the
+// node arrays are used right where the file is mapped, nothing is
+// deserialized but the names and the prototypes. numbers are in the
+// writer's byte order, an image from a host of the other order fails the
+// endian check and the file is just parsed again.
+//
+//      AstImageHeader
+//      symbol offsets  uint32_t[symbols + 1] into names
+//      names           char[]
+//      literals        double[]
+//      kinds, ops      one byte per node
+//      xs, ys          uint32_t per node
+//      call args       uint32_t[]
+//      functions       AstImageFunction[], definitions and top level
+//                      expressions in source order, then the externs
+//      params          SymbolId[] of the prototypes
+//
+// each array starts at a multiple of 8. the arrays of nodes are those of a
+// FlatExprPool. only the header, the names and the functions are checked
+// when an image is opened, the nodes are trusted the way --cache trusts
+// its object files.
+
+enum class AstSection : uint8_t {
+    SymbolOffsets,
+    Names,
+    Literals,
+    Kinds,
+    Ops,
+    Xs,
+    Ys,
+    CallArgs,
+    Functions,
+    Params,
+};
+
+static constexpr size_t ast_section_count = 10;
+
+struct AstImageFunction {
+    SymbolId name;
+    uint32_t param_begin;
+    uint32_t param_count;
+    // nodes of the body, invalid for externs
+    ExprId first;
+    ExprId body;
+};
+
+// bytes per element of each section
+static constexpr size_t AstSectionSizes[ast_section_count] = {
+    sizeof(uint32_t), 1, sizeof(double), sizeof(FlatKind), 1,
+    sizeof(uint32_t), sizeof(uint32_t), sizeof(uint32_t),
+    sizeof(AstImageFunction), sizeof(SymbolId),
+};
+
+using AstImageKey = std::array<uint8_t, 20>;
+
+struct AstImageHeader {
+    static constexpr uint32_t magic_value = 0x5453414b; // "KAST"
+    static constexpr uint32_t current_version = 1;
+    static constexpr uint32_t endian_value = 0x01020304;
+
+    uint32_t magic = magic_value;
+    uint32_t version = current_version;
+    uint32_t endian = endian_value;
+    uint32_t reserved = 0;
+    // of the source, see AstCacheDir
+    AstImageKey key;
+
+    struct Section {
+        uint64_t offset;
+        uint64_t count;
+    };
+    Section sections[ast_section_count];
+};
+
+static_assert(std::is_trivially_copyable_v<AstImageHeader>);
+
+// the image of one unit, built up in memory and written out in one go
+class AstImageWriter {
+    std::vector<uint32_t> symbol_offsets{0};
+    std::string names;
+    std::vector<double> literals;
+    std::vector<FlatKind> kinds;
+    std::vector<char> ops;
+    std::vector<uint32_t> xs;
+    std::vector<uint32_t> ys;
+    std::vector<uint32_t> call_args;
+    std::vector<AstImageFunction> functions;
+    std::vector<SymbolId> params;
+
+    uint32_t add_proto(FuncPrototype* proto) {
+        uint32_t begin = params.size();
+        for (Expr* arg : proto->get_args()) {
+            params.push_back(static_cast<VarExpr*>(arg)->get_name());
+        }
+        return begin;
+    }
+
+    void push(FlatKind kind, char op, uint32_t x, uint32_t y) {
+        kinds.push_back(kind);
+        ops.push_back(op);
+        xs.push_back(x);
+        ys.push_back(y);
+    }
+
+    template <typename T>
+    static bool write_array(FILE* f, const T* data, size_t n) {
+        static const char zeros[8] = {};
+        size_t bytes = n * sizeof(T);
+        return fwrite(data, 1, bytes, f) == bytes
+                && fwrite(zeros, 1, -bytes & 7, f) == (-bytes & 7);
+    }
+
+public:
+    // every name of symbols, in id order, so the ids of the nodes keep
+    // their meaning
+    void add_symbols(const SymbolTable& symbols) {
+        for (SymbolId id = 0; id < symbols.size(); id++) {
+            names += symbols.name(id);
+            symbol_offsets.push_back(names.size());
+        }
+    }
+
+    // the nodes of fn's body are copied over with their ids rebased, so
+    // bodies that shared a pool with others end up back to back
+    void add_function(const FlatFunction& fn) {
+        const FlatExprPool& pool = *fn.pool;
+        uint32_t base = fn.first.index;
+        uint32_t at = kinds.size();
+        for (uint32_t i = base; i <= fn.body.index; i++) {
+            ExprId id{i};
+            switch (pool.kind(id)) {
+                case FlatKind::Num:
+                    literals.push_back(pool.literal(id));
+                    push(FlatKind::Num, 0, literals.size() - 1, 0);
+                    break;
+                case FlatKind::Var:
+                    push(FlatKind::Var, 0, pool.symbol(id), 0);
+                    break;
+                case FlatKind::Binary:
+                    push(FlatKind::Binary, pool.op(id),
+                         pool.lhs(id).index - base + at,
+                         pool.rhs(id).index - base + at);
+                    break;
+                case FlatKind::Call: {
+                    uint32_t n = pool.arg_count(id);
+                    uint32_t args = call_args.size();
+                    call_args.push_back(n);
+                    for (uint32_t a = 0; a < n; a++) {
+                        call_args.push_back(pool.arg(id, a).index - base + at);
+                    }
+                    push(FlatKind::Call, 0, pool.symbol(id), args);
+                    break;
+                }
+            }
+        }
+
+        uint32_t begin = add_proto(fn.proto);
+        functions.push_back(AstImageFunction{
+                fn.proto->get_name(), begin, fn.proto->get_args().size(),
+                ExprId{at}, ExprId{uint32_t(kinds.size() - 1)}});
+    }
+
+    void add_extern(FuncPrototype* proto) {
+        uint32_t begin = add_proto(proto);
+        functions.push_back(AstImageFunction{proto->get_name(), begin,
+                                             proto->get_args().size(),
+                                             ExprId(), ExprId()});
+    }
+
+    // written under a name of its own and renamed into place like the
+    // objects of ObjectCacheDir
+    bool write(const std::string& path, const AstImageKey& key) const {
+        AstImageHeader header;
+        header.key = key;
+        size_t counts[ast_section_count] = {
+            symbol_offsets.size(), names.size(), literals.size(),
+            kinds.size(), ops.size(), xs.size(), ys.size(),
+            call_args.size(), functions.size(), params.size(),
+        };
+        uint64_t offset = (sizeof(header) + 7) & ~size_t(7);
+        for (size_t s = 0; s < ast_section_count; s++) {
+            header.sections[s].offset = offset;
+            header.sections[s].count = counts[s];
+            offset += (counts[s] * AstSectionSizes[s] + 7) & ~size_t(7);
+        }
+
+        std::string tmp = path + "." + std::to_string(getpid());
+        FILE* f = fopen(tmp.c_str(), "wb");
+        if (!f) {
+            return false;
+        }
+        bool ok = write_array(f, &header, 1)
+                && write_array(f, symbol_offsets.data(), symbol_offsets.size())
+                && write_array(f, names.data(), names.size())
+                && write_array(f, literals.data(), literals.size())
+                && write_array(f, kinds.data(), kinds.size())
+                && write_array(f, ops.data(), ops.size())
+                && write_array(f, xs.data(), xs.size())
+                && write_array(f, ys.data(), ys.size())
+                && write_array(f, call_args.data(), call_args.size())
+                && write_array(f, functions.data(), functions.size())
+                && write_array(f, params.data(), params.size());
+        ok = fclose(f) == 0 && ok;
+        if (ok && rename(tmp.c_str(), path.c_str()) == 0) {
+            return true;
+        }
+        unlink(tmp.c_str());
+        return false;
+    }
+};
+
+// an image mapped for reading, valid as long as this is
+class AstImage {
+    MappedFileSource file;
+    const AstImageHeader* header = nullptr;
+
+    template <typename T>
+    const T* section(AstSection s) const {
+        return reinterpret_cast<const T*>(
+                file.data() + header->sections[size_t(s)].offset);
+    }
+
+    size_t count(AstSection s) const {
+        return header->sections[size_t(s)].count;
+    }
+
+    bool check() const {
+        if (file.size() < sizeof(AstImageHeader)
+                || reinterpret_cast<uintptr_t>(file.data()) % 8 != 0) {
+            return false;
+        }
+        if (header->magic != AstImageHeader::magic_value
+                || header->version != AstImageHeader::current_version
+                || header->endian != AstImageHeader::endian_value) {
+            return false;
+        }
+        for (size_t s = 0; s < ast_section_count; s++) {
+            const AstImageHeader::Section& sec = header->sections[s];
+            if (sec.offset % 8 != 0 || sec.offset > file.size()
+                    || sec.count > (file.size() - sec.offset)
+                            / AstSectionSizes[s]) {
+                return false;
+            }
+        }
+
+        size_t nodes = count(AstSection::Kinds);
+        if (count(AstSection::SymbolOffsets) == 0
+                || count(AstSection::Ops) != nodes
+                || count(AstSection::Xs) != nodes
+                || count(AstSection::Ys) != nodes) {
+            return false;
+        }
+        const uint32_t* offsets = section<uint32_t>(AstSection::SymbolOffsets);
+        for (size_t i = 0; i < symbol_count(); i++) {
+            if (offsets[i] > offsets[i + 1]) {
+                return false;
+            }
+        }
+        if (offsets[symbol_count()] > count(AstSection::Names)) {
+            return false;
+        }
+
+        const SymbolId* ps = params();
+        for (size_t i = 0; i < count(AstSection::Params); i++) {
+            if (ps[i] >= symbol_count()) {
+                return false;
+            }
+        }
+        for (const AstImageFunction& fn : functions()) {
+            if (fn.name >= symbol_count()
+                    || fn.param_begin > count(AstSection::Params)
+                    || fn.param_count > count(AstSection::Params)
+                            - fn.param_begin) {
+                return false;
+            }
+            if (fn.body && (fn.body.index >= nodes
+                            || fn.first.index > fn.body.index)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+public:
+    // false if there is no image at path, or it is not one for key
+    bool open(const std::string& path, const AstImageKey& key) {
+        if (!file.open(path.c_str())) {
+            return false;
+        }
+        header = reinterpret_cast<const AstImageHeader*>(file.data());
+        return check() && header->key == key;
+    }
+
+    uint32_t symbol_count() const {
+        return count(AstSection::SymbolOffsets) - 1;
+    }
+
+    std::string_view symbol_name(SymbolId id) const {
+        const uint32_t* offsets = section<uint32_t>(AstSection::SymbolOffsets);
+        return std::string_view(section<char>(AstSection::Names) + offsets[id],
+                                offsets[id + 1] - offsets[id]);
+    }
+
+    llvm::ArrayRef<AstImageFunction> functions() const {
+        return llvm::ArrayRef<AstImageFunction>(
+                section<AstImageFunction>(AstSection::Functions),
+                count(AstSection::Functions));
+    }
+
+    const SymbolId* params() const {
+        return section<SymbolId>(AstSection::Params);
+    }
+
+    // the nodes of every body, read in place
+    FlatExprPool pool() const {
+        return FlatExprPool::mapped(FlatArrays{
+                section<FlatKind>(AstSection::Kinds),
+                section<char>(AstSection::Ops),
+                section<uint32_t>(AstSection::Xs),
+                section<uint32_t>(AstSection::Ys),
+                section<double>(AstSection::Literals),
+                section<uint32_t>(AstSection::CallArgs),
+                static_cast<uint32_t>(count(AstSection::Kinds))});
+    }
+};
+
+// images of the input files of the parallel driver kept in a directory
+// across runs, set with --ast-cache=<dir>. an image is looked up by a hash
+// of its file's identity, size and modification times together with the
+// format version, the operator precedences and the builder flags, which
+// is everything that decides what parsing the file yields. a file that
+// had errors is never stored, so they are reported again on every run.
+class AstCacheDir {
+    static constexpr const char* key_prefix = "kast.";
+
+    std::string dir;
+
+public:
+    std::atomic<uint32_t> hits{0};
+    uint32_t stored = 0;
+
+    bool open(const char* path) {
+        dir = path;
+        if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+            stderr_output().error("could not create %s: %s", path,
+                    strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    // false if the file can't be looked at, it won't open either then
+    static bool key_of(const char* path, AstImageKey& key) {
+        struct stat st;
+        if (stat(path, &st) != 0) {
+            return false;
+        }
+        uint64_t id[] = {
+            uint64_t(st.st_dev), uint64_t(st.st_ino), uint64_t(st.st_size),
+            uint64_t(st.st_mtim.tv_sec), uint64_t(st.st_mtim.tv_nsec),
+            uint64_t(st.st_ctim.tv_sec), uint64_t(st.st_ctim.tv_nsec),
+            AstImageHeader::current_version,
+            uint64_t(FoldConstants) | uint64_t(FoldFastMath) << 1
+                    | uint64_t(HashConsing) << 2,
+        };
+        llvm::SHA1 sha;
+        sha.update(llvm::StringRef(reinterpret_cast<const char*>(id),
+                                   sizeof(id)));
+        sha.update(llvm::StringRef(
+                reinterpret_cast<const char*>(BinopPrecedence.data()),
+                sizeof(BinopPrecedence)));
+        llvm::StringRef hash = sha.final();
+        memcpy(key.data(), hash.data(), key.size());
+        return true;
+    }
+
+    std::string path_of(const AstImageKey& key) const {
+        return dir + "/" + key_prefix
+                + llvm::toHex(llvm::ArrayRef<uint8_t>(key), true);
+    }
+};
+
+
+/////////////////////
+/* PARALLEL DRIVER */
+/////////////////////
+
+// the parsed top level items of one or more inputs. unlike the repl, which
+// drops each item once handled, all of their ASTs are kept alive here.
+// bodies are flat, many to a pool, and the pools are either parsed or
+// mapped from an --ast-cache image.
+struct TranslationUnit {
+    // a pool with whatever its nodes and symbol map live in. held by
+    // pointer so the FlatFunctions into it survive merges.
+    struct Bodies {
+        FlatExprPool pool;
+        // from the ids of the unit the pool was parsed into to this one's,
+        // empty while they are the same
+        std::vector<SymbolId> symbol_map;
+        std::unique_ptr<AstImage> image;
+    };
+
+    SymbolTable symbols;
+    // the prototypes
+    std::vector<AstContext> arenas;
+    std::vector<std::unique_ptr<Bodies>> bodies;
+
+    // definitions and top level expressions, in source order
+    std::vector<FlatFunction> functions;
+    std::vector<FuncPrototype*> externs;
+    // where the functions of each of the inputs of parse_files() end
+    std::vector<size_t> input_ends;
+
+    // top level items that failed to parse, and why. the spans are into
+    // the input the unit was parsed from.
+    size_t errors = 0;
+    Diagnostics diagnostics;
+};
+
+template <typename B>
+static void parse_tokens_with(TokenStream& toks, TranslationUnit& unit,
+                              AstContext& ctx) {
+    unit.bodies.push_back(std::make_unique<TranslationUnit::Bodies>());
+    B flat(unit.bodies.back()->pool);
+    Parser<B> p(toks, flat, ctx);
+
+    p.get_next_token();
+    while (p.current() != tok_eof) {
+        FlatFunction fn;
+        FuncPrototype* ext = nullptr;
+        switch (p.current()) {
+            case ';':
+                p.get_next_token();
+                continue;
+            case tok_def:
+                fn = p.parse_definition();
+                break;
+            case tok_extern:
+                ext = p.parse_extern();
+                break;
+            default:
+                fn = p.parse_toplevel_expr();
+                break;
+        }
+
+        if (fn) {
+            unit.functions.push_back(fn);
+        } else if (ext) {
+            unit.externs.push_back(ext);
+        } else {
+            ++unit.errors;
+            p.recover();
+        }
+    }
+    unit.diagnostics = std::move(p.diagnostics());
+    stats_add_nodes(p.nodes());
+    stats_arena_size(ctx.bytes_used());
+}
+
+static void parse_tokens(TokenStream& toks, TranslationUnit& unit,
+                         AstContext& ctx) {
+    with_builder<FlatBuilder>([&](auto tag) {
+        using B = typename decltype(tag)::type;
+        parse_tokens_with<B>(toks, unit, ctx);
+    });
+}
+
+// parses all of src into unit, which must be empty
+static void parse_unit(InputSource& src, TranslationUnit& unit) {
+    unit.arenas.emplace_back();
+    AstContext& ctx = unit.arenas.back();
+    with_tokens(src, unit.symbols, DriverTokenFeed, [&](TokenStream& toks) {
+        parse_tokens(toks, unit, ctx);
+    });
+}
+
+// moves everything parsed in part into unit, in order after what is there
+// already, translating its symbols into unit's table. the prototypes are
+// rewritten, the bodies only get their symbol maps composed with part's.
+static void merge_unit(TranslationUnit& unit, TranslationUnit&& part) {
+    // nothing to translate into, so part's ids can stay as they are
+    if (unit.functions.empty() && unit.externs.empty()
+            && unit.symbols.size() == sym_anon_expr + 1
+            && unit.errors == 0) {
+        std::vector<size_t> ends = std::move(unit.input_ends);
+        unit = std::move(part);
+        unit.input_ends = std::move(ends);
+        return;
+    }
+
+    std::vector<SymbolId> map(part.symbols.size());
+    for (SymbolId id = 0; id < map.size(); id++) {
+        map[id] = unit.symbols.intern(part.symbols.name(id));
+    }
+
+    for (auto& bodies : part.bodies) {
+        if (bodies->symbol_map.empty()) {
+            bodies->symbol_map = map;
+        } else {
+            for (SymbolId& id : bodies->symbol_map) {
+                id = map[id];
+            }
+        }
+        bodies->pool.set_symbol_map(bodies->symbol_map.data());
+        unit.bodies.push_back(std::move(bodies));
+    }
+
+    std::vector<Expr*> work;
+    auto remap_proto = [&](FuncPrototype* proto) {
+        proto->set_name(map[proto->get_name()]);
+        for (Expr* arg : proto->get_args()) {
+            remap_symbols(arg, map, work);
+        }
+    };
+    for (const FlatFunction& fn : part.functions) {
+        remap_proto(fn.proto);
+        unit.functions.push_back(fn);
+    }
+    for (FuncPrototype* proto : part.externs) {
+        remap_proto(proto);
+        unit.externs.push_back(proto);
+    }
+
+    for (AstContext& ctx : part.arenas) {
+        unit.arenas.push_back(std::move(ctx));
+    }
+    unit.errors += part.errors;
+    unit.diagnostics.append(std::move(part.diagnostics));
+}
+
+// fills unit, which must be empty, from an image. the names are interned
+// and the prototypes built again, the bodies stay where they are mapped.
+static void load_unit(std::unique_ptr<AstImage> image, TranslationUnit& unit) {
+    auto bodies = std::make_unique<TranslationUnit::Bodies>();
+    bodies->pool = image->pool();
+
+    // a new table hands out the ids in the order the names were written,
+    // so the map is only needed if the image has names twice
+    bool same = true;
+    std::vector<SymbolId> map(image->symbol_count());
+    for (SymbolId id = 0; id < map.size(); id++) {
+        map[id] = unit.symbols.intern(image->symbol_name(id));
+        same = same && map[id] == id;
+    }
+    if (!same) {
+        bodies->symbol_map = std::move(map);
+        bodies->pool.set_symbol_map(bodies->symbol_map.data());
+    }
+    auto id_of = [&](SymbolId id) {
+        return bodies->symbol_map.empty() ? id : bodies->symbol_map[id];
+    };
+
+    unit.arenas.emplace_back();
+    AstContext& ctx = unit.arenas.back();
+    TreeBuilder protos(ctx);
+    const SymbolId* params = image->params();
+    for (const AstImageFunction& fn : image->functions()) {
+        size_t mark = protos.begin_args();
+        for (uint32_t i = 0; i < fn.param_count; i++) {
+            protos.push_arg(protos.var(id_of(params[fn.param_begin + i])));
+        }
+        auto proto = ctx.make<FuncPrototype>(id_of(fn.name),
+                                             protos.pop_args(mark));
+        if (fn.body) {
+            unit.functions.push_back(FlatFunction{proto, &bodies->pool,
+                                                  fn.body, fn.first});
+        } else {
+            unit.externs.push_back(proto);
+        }
+    }
+
+    bodies->image = std::move(image);
+    unit.bodies.push_back(std::move(bodies));
+}
+
+// writes the image of unit, see AST IMAGE
+static bool save_unit(const TranslationUnit& unit, const std::string& path,
+                      const AstImageKey& key) {
+    AstImageWriter writer;
+    writer.add_symbols(unit.symbols);
+    for (const FlatFunction& fn : unit.functions) {
+        writer.add_function(fn);
+    }
+    for (FuncPrototype* proto : unit.externs) {
+        writer.add_extern(proto);
+    }
+    return writer.write(path, key);
+}
+
+static bool is_keyword_text(const char* begin, const char* end) {
+    std::string_view text(begin, end - begin);
+    return text == "def" || text == "extern";
+}
+
+// offsets into src at which the input can be cut into chunks of roughly
+// target bytes that parse on their own. only cuts where a top level item
+// starts, which is where main_loop() dispatches: after a ';' or at a 'def'
+// or 'extern', with no call left open. there are no comments or strings in
+// the language, so scanning the same runs the lexer does is exact.
+static std::vector<size_t> find_chunk_cuts(const InputSource& src,
+                                           size_t target) {
+    std::vector<size_t> cuts;
+    const char* begin = src.data();
+    const char* end = src.end();
+    const char* last_cut = begin;
+    const char* p = begin;
+    int depth = 0;
+
+    while (p < end) {
+        if (char_is(*p, cc_alpha)) {
+            const char* word = p;
+            p = skip_class<cc_alnum>(p, end);
+            if (depth == 0 && word - last_cut >= (ptrdiff_t)target
+                    && is_keyword_text(word, p)) {
+                cuts.push_back(word - begin);
+                last_cut = word;
+            }
+        } else if (char_is(*p, cc_number)) {
+            p = skip_class<cc_number>(p, end);
+        } else if (char_is(*p, cc_space)) {
+            p = skip_class<cc_space>(p, end);
+        } else {
+            if (*p == '(') {
+                ++depth;
+            } else if (*p == ')') {
+                // unbalanced ')' is a parse error, not a reason to never
+                // cut again
+                depth = std::max(depth - 1, 0);
+            } else if (*p == ';' && depth == 0
+                    && p + 1 - last_cut >= (ptrdiff_t)target) {
+                cuts.push_back(p + 1 - begin);
+                last_cut = p + 1;
+            }
+            ++p;
+        }
+    }
+    return cuts;
+}
+
+// splits every file into chunks at top level item boundaries and parses
+// the chunks of all of them in parallel, each with its own lexer, symbol
+// table and arena. the results are merged in the order the files were
+// given, chunks in source order. with a cache, a file whose image is in it
+// is mapped instead of being parsed, and one that parses cleanly is stored.
+static bool parse_files(const std::vector<const char*>& paths,
+                        unsigned jobs, TranslationUnit& unit,
+                        AstCacheDir* cache = nullptr) {
+    struct Chunk {
+        size_t file;
+        size_t begin, end;
+        TranslationUnit result;
+    };
+
+    std::vector<MappedFileSource> files(paths.size());
+    std::vector<char> opened(paths.size(), false);
+    std::vector<std::vector<size_t>> cuts(paths.size());
+    std::vector<AstImageKey> keys(paths.size());
+    std::vector<char> keyed(paths.size(), false);
+    std::vector<std::unique_ptr<AstImage>> images(paths.size());
+
+    // the pre-scan of each file runs alongside those of the others
+    {
+        ThreadPool pool(std::min<size_t>(jobs, paths.size()));
+        for (size_t i = 0; i < paths.size(); i++) {
+            pool.submit([&, i] {
+                if (cache && AstCacheDir::key_of(paths[i], keys[i])) {
+                    keyed[i] = true;
+                    auto image = std::make_unique<AstImage>();
+                    if (image->open(cache->path_of(keys[i]), keys[i])) {
+                        images[i] = std::move(image);
+                        opened[i] = true;
+                        ++cache->hits;
+                        return;
+                    }
+                }
+                if (!files[i].open(paths[i])) {
+                    return;
+                }
+                opened[i] = true;
+                size_t target = std::max<size_t>(64 << 10,
+                                                 files[i].size() / (jobs * 8));
+                cuts[i] = find_chunk_cuts(files[i], target);
+            });
+        }
+        pool.wait();
+    }
+
+    std::vector<Chunk> chunks;
+    for (size_t i = 0; i < paths.size(); i++) {
+        if (!opened[i] || images[i]) {
+            continue;
+        }
+        size_t begin = 0;
+        for (size_t cut : cuts[i]) {
+            chunks.push_back(Chunk{i, begin, cut, {}});
+            begin = cut;
+        }
+        chunks.push_back(Chunk{i, begin, files[i].size(), {}});
+    }
+
+    parallel_for_stealing(chunks.size(), jobs, [&](size_t c) {
+        Chunk& chunk = chunks[c];
+        // copied so the lexer gets its '\0' sentinel at the end of the chunk
+        const char* data = files[chunk.file].data();
+        MemorySource src(std::string(data + chunk.begin, data + chunk.end));
+        parse_unit(src, chunk.result);
+        chunk.result.diagnostics.shift(static_cast<uint32_t>(chunk.begin));
+    });
+
+    bool ok = true;
+    size_t next = 0;
+    for (size_t i = 0; i < paths.size(); i++) {
+        if (!opened[i]) {
+            report_open_error(files[i], paths[i]);
+            ok = false;
+            unit.input_ends.push_back(unit.functions.size());
+            continue;
+        }
+
+        TranslationUnit file;
+        if (images[i]) {
+            load_unit(std::move(images[i]), file);
+            stderr_output().note("%s: ast cache, %zu functions, %zu externs",
+                    paths[i], file.functions.size(), file.externs.size());
+            merge_unit(unit, std::move(file));
+            unit.input_ends.push_back(unit.functions.size());
+            continue;
+        }
+
+        size_t count = 0;
+        for (; next < chunks.size() && chunks[next].file == i; next++) {
+            merge_unit(file, std::move(chunks[next].result));
+            ++count;
+        }
+        if (keyed[i] && file.errors == 0
+                && save_unit(file, cache->path_of(keys[i]), keys[i])) {
+            ++cache->stored;
+        }
+        file.diagnostics.flush(paths[i], files[i].data(), files[i].size(),
+                               stderr_output());
+        stderr_output().note("%s: %zu chunks, %zu functions, %zu externs, "
+                "%zu errors", paths[i], count, file.functions.size(),
+                file.externs.size(), file.errors);
+        merge_unit(unit, std::move(file));
+        unit.input_ends.push_back(unit.functions.size());
+    }
+    return ok;
+}
+
+
+////////////////////
+/* BATCH COMPILER */
+////////////////////
+
+// counts the nodes of fn's body and appends the callee of every call in it
+// to calls
+static size_t collect_calls(const FlatFunction& fn,
+                            std::vector<SymbolId>& calls) {
+    const FlatExprPool& pool = *fn.pool;
+    for (uint32_t i = fn.first.index; i <= fn.body.index; i++) {
+        if (pool.kind(ExprId{i}) == FlatKind::Call) {
+            calls.push_back(pool.symbol(ExprId{i}));
+        }
+    }
+    return fn.body.index - fn.first.index + 1;
+}
+
+// target machine for the host triple, for code that is shipped rather
+// than run here, so no cpu specific features
+static std::unique_ptr<llvm::TargetMachine> batch_target_machine() {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+
+    std::string triple = llvm::sys::getDefaultTargetTriple();
+    std::string error;
+    const llvm::Target* target =
+            llvm::TargetRegistry::lookupTarget(triple, error);
+    if (!target) {
+        stderr_output().error("%s", error.c_str());
+        return nullptr;
+    }
+    return std::unique_ptr<llvm::TargetMachine>(target->createTargetMachine(
+            triple, "generic", "", llvm::TargetOptions(),
+            llvm::Reloc::PIC_));
+}
+
+// codegen of module into an object file. tm can only do one at a time.
+static bool emit_object(llvm::Module& module, llvm::TargetMachine& tm,
+                        llvm::raw_pwrite_stream& out) {
+    llvm::legacy::PassManager pm;
+    if (tm.addPassesToEmitFile(pm, out, nullptr, llvm::CGFT_ObjectFile)) {
+        stderr_output().error("the target can't emit object files");
+        return false;
+    }
+    pm.run(module);
+    return true;
+}
+
+// writes module to path: textual IR for .ll, bitcode for .bc and an
+// object file for anything else
+static bool batch_emit(llvm::Module& module, llvm::TargetMachine& tm,
+                       const char* path) {
+    PhaseScope scope(Phase::Emit);
+    std::error_code ec;
+    llvm::raw_fd_ostream out(path, ec, llvm::sys::fs::OF_None);
+    if (ec) {
+        stderr_output().error("could not open %s: %s", path,
+                ec.message().c_str());
+        return false;
+    }
+
+    llvm::StringRef ext = llvm::StringRef(path).rsplit('.').second;
+    if (ext == "ll") {
+        module.print(out, nullptr);
+    } else if (ext == "bc") {
+        llvm::WriteBitcodeToFile(module, out);
+    } else if (!emit_object(module, tm, out)) {
+        return false;
+    }
+    out.flush();
+    return !out.has_error();
+}
+
+// the definitions of a unit that are compiled, the last one of each name
+// as in the repl, in the order of the first one
+struct UnitDefinitions {
+    // SymbolId indexed, -1 for names neither declared nor defined
+    std::vector<int32_t> arity;
+    // into TranslationUnit::functions
+    std::vector<uint32_t> defs;
+    // externs disagreeing with an earlier one
+    size_t errors = 0;
+    // top level expressions, which have nowhere to run
+    size_t skipped = 0;
+};
+
+static UnitDefinitions collect_definitions(const TranslationUnit& unit) {
+    UnitDefinitions d;
+    d.arity.assign(unit.symbols.size(), -1);
+    std::vector<uint32_t> last(unit.symbols.size(), UINT32_MAX);
+    for (FuncPrototype* proto : unit.externs) {
+        int32_t n = proto->get_args().size();
+        int32_t& arity = d.arity[proto->get_name()];
+        if (arity >= 0 && arity != n) {
+            log_error_v("redeclaration with a different number of arguments");
+            ++d.errors;
+            continue;
+        }
+        arity = n;
+    }
+    for (uint32_t i = 0; i < unit.functions.size(); i++) {
+        FuncPrototype* proto = unit.functions[i].proto;
+        SymbolId name = proto->get_name();
+        if (name == sym_anon_expr) {
+            ++d.skipped;
+            continue;
+        }
+        if (last[name] == UINT32_MAX) {
+            d.defs.push_back(i);
+        }
+        last[name] = i;
+        d.arity[name] = proto->get_args().size();
+    }
+    for (uint32_t& i : d.defs) {
+        i = last[unit.functions[i].proto->get_name()];
+    }
+    return d;
+}
+
+// compiles the definitions of a whole unit into the one output file at
+// path, with all threads:
+//
+//  1.  the last definition of each name wins, as it would in the repl,
+//      and every function can call any other one wherever it is defined
+//  2.  definitions are grouped into a few modules per thread, callers
+//      with their callees as far as the size cap of a module allows, so
+//      the optimizer still sees most calls it could inline. with
+//      --profile-use the hottest calls are the ones it sees.
+//  3.  each module gets codegen and the full module pipeline of the -O
+//      level on a thread of its own, in the thread's own LLVMContext,
+//      and is handed back as bitcode since contexts can't be shared
+//  4.  the modules are read back into one context, linked and emitted
+//
+// top level expressions have nowhere to run in an object file and are
+// skipped.
+static bool compile_unit(TranslationUnit& unit, unsigned jobs,
+                         const char* path) {
+    auto tm = batch_target_machine();
+    if (!tm) {
+        return false;
+    }
+    std::string triple = tm->getTargetTriple().str();
+    std::string layout = tm->createDataLayout().getStringRepresentation();
+
+    // 1. what each name is
+    UnitDefinitions d = collect_definitions(unit);
+    const std::vector<int32_t>& arity = d.arity;
+    size_t errors = d.errors;
+    std::vector<FlatFunction> defs;
+    for (uint32_t i : d.defs) {
+        defs.push_back(unit.functions[i]);
+    }
+
+    // 2. union-find over the calls between definitions, merging two
+    // groups only while they stay under the cap
+    size_t units = std::max<size_t>(1, std::min<size_t>(defs.size(),
+                                                        jobs * 4));
+    std::vector<uint32_t> index(unit.symbols.size(), UINT32_MAX);
+    for (uint32_t i = 0; i < defs.size(); i++) {
+        index[defs[i].proto->get_name()] = i;
+    }
+    std::vector<std::vector<SymbolId>> calls(defs.size());
+    std::vector<size_t> size(defs.size());
+    std::vector<uint32_t> parent(defs.size());
+    size_t total = 0;
+    for (uint32_t i = 0; i < defs.size(); i++) {
+        size[i] = collect_calls(defs[i], calls[i]);
+        parent[i] = i;
+        total += size[i];
+    }
+    auto root = [&](uint32_t i) {
+        while (parent[i] != i) {
+            i = parent[i] = parent[parent[i]];
+        }
+        return i;
+    };
+    // with --profile-use the calls made most often are merged first, so
+    // they are the ones kept within a module
+    struct Edge {
+        uint32_t caller;
+        uint32_t callee;
+        uint64_t calls;
+    };
+    std::vector<Edge> edges;
+    for (uint32_t i = 0; i < defs.size(); i++) {
+        for (SymbolId callee : calls[i]) {
+            if (index[callee] != UINT32_MAX) {
+                edges.push_back(Edge{i, index[callee], 0});
+            }
+        }
+    }
+    if (ProfileUse) {
+        auto name_of = [&](SymbolId id) {
+            std::string_view name = unit.symbols.name(id);
+            return llvm::StringRef(name.data(), name.size());
+        };
+        for (Edge& e : edges) {
+            e.calls = ProfileUse->edge_calls(
+                    name_of(defs[e.caller].proto->get_name()),
+                    name_of(defs[e.callee].proto->get_name()));
+        }
+        std::stable_sort(edges.begin(), edges.end(),
+                         [](const Edge& a, const Edge& b) {
+                             return a.calls > b.calls;
+                         });
+    }
+    size_t cap = (total + units - 1) / units;
+    for (const Edge& e : edges) {
+        uint32_t a = root(e.caller);
+        uint32_t b = root(e.callee);
+        if (a != b && size[a] + size[b] <= cap) {
+            parent[b] = a;
+            size[a] += size[b];
+        }
+    }
+
+    // groups in order of their first definition, dealt out largest first
+    // to whichever module is smallest so far
+    std::vector<uint32_t> groups;
+    for (uint32_t i = 0; i < defs.size(); i++) {
+        if (root(i) == i) {
+            groups.push_back(i);
+        }
+    }
+    std::stable_sort(groups.begin(), groups.end(), [&](uint32_t a, uint32_t b) {
+        return size[a] > size[b];
+    });
+    units = std::min(units, groups.size());
+    std::vector<size_t> load(units, 0);
+    std::vector<uint32_t> module_of(defs.size());
+    for (uint32_t g : groups) {
+        size_t m = std::min_element(load.begin(), load.end()) - load.begin();
+        module_of[g] = m;
+        load[m] += size[g];
+    }
+    std::vector<std::vector<FlatFunction>> modules(units);
+    for (uint32_t i = 0; i < defs.size(); i++) {
+        modules[module_of[root(i)]].push_back(defs[i]);
+    }
+
+    // 3. codegen and optimization
+    std::vector<std::string> bitcode(units);
+    std::atomic<size_t> failed{0};
+    parallel_for_stealing(units, jobs, [&](size_t m) {
+        std::string name = "batch." + std::to_string(m);
+        CodeGen cg(unit.symbols, name.c_str());
+        cg.set_data_layout(llvm::DataLayout(layout));
+        cg.get_module().setTargetTriple(triple);
+        for (SymbolId id = 0; id < arity.size(); id++) {
+            if (arity[id] >= 0) {
+                cg.declare_known(id, arity[id]);
+            }
+        }
+
+        for (const FlatFunction& fn : modules[m]) {
+            if (!cg.codegen(fn)) {
+                ++failed;
+            }
+        }
+
+        Optimizer opt(OptLevel);
+        opt.optimize_module(cg.get_module());
+
+        llvm::raw_string_ostream os(bitcode[m]);
+        llvm::WriteBitcodeToFile(cg.get_module(), os);
+        os.flush();
+    });
+    errors += failed;
+
+    // 4. link
+    llvm::LLVMContext ctx;
+    llvm::Module linked("batch", ctx);
+    linked.setTargetTriple(triple);
+    linked.setDataLayout(layout);
+    llvm::Linker linker(linked);
+    for (size_t m = 0; m < units; m++) {
+        auto part = llvm::parseBitcodeFile(
+                llvm::MemoryBufferRef(bitcode[m], "batch"), ctx);
+        if (!part) {
+            stderr_output().error("%s",
+                    llvm::toString(part.takeError()).c_str());
+            return false;
+        }
+        if (linker.linkInModule(std::move(*part))) {
+            return false;
+        }
+        std::string().swap(bitcode[m]);
+    }
+
+    bool ok = batch_emit(linked, *tm, path);
+    stderr_output().note("compiled %zu functions in %zu modules to %s: %zu "
+            "errors, %zu top level expressions skipped", defs.size(),
+            units, path, errors, d.skipped);
+    return ok && errors == 0;
+}
+
+// --thin-lto has compile_library() hand each input on as thin lto bitcode
+// and compile them all at the link
+static bool ThinLto = false;
+
+struct LibraryMember {
+    std::string name;
+    llvm::SmallString<0> object;
+};
+
+// writes the objects as an archive at path, or for a .so links them with
+// the system compiler driver
+static bool write_library(const std::vector<LibraryMember>& members,
+                          const char* path) {
+    PhaseScope scope(Phase::Emit);
+    if (llvm::StringRef(path).endswith(".a")) {
+        std::vector<llvm::NewArchiveMember> archive;
+        for (const LibraryMember& m : members) {
+            llvm::NewArchiveMember member(
+                    llvm::MemoryBufferRef(m.object, m.name));
+            member.MemberName = m.name;
+            archive.push_back(std::move(member));
+        }
+        if (llvm::Error err = llvm::writeArchive(
+                path, archive, true, llvm::object::Archive::K_GNU, true,
+                false)) {
+            stderr_output().error("could not write %s: %s", path,
+                    llvm::toString(std::move(err)).c_str());
+            return false;
+        }
+        return true;
+    }
+
+    auto cc = llvm::sys::findProgramByName("cc");
+    if (!cc) {
+        stderr_output().error("no cc to link %s with", path);
+        return false;
+    }
+    llvm::SmallString<128> dir;
+    if (llvm::sys::fs::createUniqueDirectory("kaleidoscope-lib", dir)) {
+        stderr_output().error("could not create a directory to link %s in",
+                path);
+        return false;
+    }
+
+    bool ok = true;
+    std::vector<std::string> objects;
+    for (size_t i = 0; i < members.size() && ok; i++) {
+        llvm::SmallString<128> object = dir;
+        llvm::sys::path::append(object, std::to_string(i) + ".o");
+        std::error_code ec;
+        llvm::raw_fd_ostream out(object, ec, llvm::sys::fs::OF_None);
+        out << members[i].object;
+        out.close();
+        ok = !ec && !out.has_error();
+        objects.push_back(object.str().str());
+    }
+
+    if (ok) {
+        std::vector<llvm::StringRef> args = {*cc, "-shared", "-o", path};
+        for (const std::string& object : objects) {
+            args.push_back(object);
+        }
+        std::string message;
+        int rc = llvm::sys::ExecuteAndWait(*cc, args, llvm::None, {}, 0, 0,
+                                           &message);
+        ok = rc == 0;
+        if (!ok) {
+            stderr_output().error("linking %s failed%s%s", path,
+                    message.empty() ? "" : ": ", message.c_str());
+        }
+    } else {
+        stderr_output().error("could not write the objects of %s", path);
+    }
+
+    for (const std::string& object : objects) {
+        llvm::sys::fs::remove(object);
+    }
+    llvm::sys::fs::remove(dir);
+    return ok;
+}
+
+// compiles the definitions of a unit parsed by parse_files() into a
+// library at path, a static one for .a and a shared one for .so, that a C
+// or C++ program links against and calls as double name(double, ...):
+//
+//  1.  the last definition of each name wins, as in compile_unit()
+//  2.  every input became a module of its own, which gets codegen on a
+//      thread of its own with all names it can call declared
+//  3.  without --thin-lto the module gets the full module pipeline and
+//      codegen into an object, so calls to other inputs stay calls
+//  4.  with --thin-lto it gets the thin lto pre-link pipeline and is kept
+//      as bitcode with a summary. the link then reads the summaries of
+//      all of them, imports what is worth inlining from one module into
+//      another, so calls between inputs can be inlined as those within
+//      one can, and optimizes and compiles each module on all threads
+//  5.  the objects, one per input with a definition, go into the library
+//
+// top level expressions are skipped as they are by compile_unit().
+static bool compile_library(TranslationUnit& unit,
+                            const std::vector<const char*>& paths,
+                            unsigned jobs, const char* path) {
+    llvm::StringRef out_path(path);
+    bool shared = out_path.endswith(".so");
+    if (!shared && !out_path.endswith(".a")) {
+        stderr_output().error("--emit-lib needs a .a or .so path, not %s",
+                path);
+        return false;
+    }
+    auto tm = batch_target_machine();
+    if (!tm) {
+        return false;
+    }
+    std::string triple = tm->getTargetTriple().str();
+    std::string layout = tm->createDataLayout().getStringRepresentation();
+
+    // 1.
+    UnitDefinitions d = collect_definitions(unit);
+    std::vector<std::vector<FlatFunction>> inputs(paths.size());
+    for (uint32_t i : d.defs) {
+        size_t input = std::upper_bound(unit.input_ends.begin(),
+                                        unit.input_ends.end(), i)
+                - unit.input_ends.begin();
+        inputs[input].push_back(unit.functions[i]);
+    }
+    std::vector<size_t> used;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        if (!inputs[i].empty()) {
+            used.push_back(i);
+        }
+    }
+
+    // 2. to 4. up to the thin lto link. objects, or bitcode for the link
+    std::vector<LibraryMember> members(used.size());
+    std::atomic<size_t> failed{0};
+    parallel_for_stealing(used.size(), jobs, [&](size_t m) {
+        const char* input = paths[used[m]];
+        members[m].name = llvm::sys::path::filename(input).str() + ".o";
+        CodeGen cg(unit.symbols, input);
+        cg.set_data_layout(llvm::DataLayout(layout));
+        cg.get_module().setTargetTriple(triple);
+        for (SymbolId id = 0; id < d.arity.size(); id++) {
+            if (d.arity[id] >= 0) {
+                cg.declare_known(id, d.arity[id]);
+            }
+        }
+        for (const FlatFunction& fn : inputs[used[m]]) {
+            if (!cg.codegen(fn)) {
+                ++failed;
+            }
+        }
+
+        Optimizer opt(OptLevel);
+        llvm::raw_svector_ostream os(members[m].object);
+        if (ThinLto) {
+            opt.thin_lto_prelink(cg.get_module(), os);
+            return;
+        }
+        opt.optimize_module(cg.get_module());
+        // a target machine only emits one module at a time
+        auto emit_tm = batch_target_machine();
+        if (!emit_tm || !emit_object(cg.get_module(), *emit_tm, os)) {
+            ++failed;
+        }
+    });
+    size_t errors = d.errors + failed;
+
+    // 4. the link. every definition is kept, the library exports them all
+    if (ThinLto && !used.empty()) {
+        PhaseScope scope(Phase::Emit);
+        llvm::lto::Config conf;
+        conf.CPU = "generic";
+        conf.RelocModel = llvm::Reloc::PIC_;
+        conf.DefaultTriple = triple;
+        conf.OptLevel = OptLevel;
+        conf.CGOptLevel = OptLevel == 0 ? llvm::CodeGenOpt::None
+                                        : llvm::CodeGenOpt::Default;
+        llvm::lto::LTO lto(std::move(conf), llvm::lto::createInProcessThinBackend(
+                llvm::heavyweight_hardware_concurrency(jobs)));
+
+        for (size_t m = 0; m < members.size(); m++) {
+            auto file = llvm::lto::InputFile::create(llvm::MemoryBufferRef(
+                    members[m].object, paths[used[m]]));
+            if (!file) {
+                stderr_output().error("%s",
+                        llvm::toString(file.takeError()).c_str());
+                return false;
+            }
+            std::vector<llvm::lto::SymbolResolution> res;
+            for (const llvm::lto::InputFile::Symbol& sym : (*file)->symbols()) {
+                llvm::lto::SymbolResolution r;
+                if (!sym.isUndefined()) {
+                    r.Prevailing = true;
+                    r.VisibleToRegularObj = true;
+                    // a shared object's definitions can be interposed
+                    r.FinalDefinitionInLinkageUnit = !shared;
+                }
+                res.push_back(r);
+            }
+            if (llvm::Error err = lto.add(std::move(*file), res)) {
+                stderr_output().error("%s",
+                        llvm::toString(std::move(err)).c_str());
+                return false;
+            }
+        }
+
+        // task 0 is the regular lto partition, there is none. the thin
+        // ones follow in the order the modules were added.
+        std::vector<llvm::SmallString<0>> objects(lto.getMaxTasks());
+        auto add_stream = [&](unsigned task)
+                -> llvm::Expected<std::unique_ptr<llvm::CachedFileStream>> {
+            return std::make_unique<llvm::CachedFileStream>(
+                    std::make_unique<llvm::raw_svector_ostream>(
+                            objects[task]));
+        };
+        if (llvm::Error err = lto.run(add_stream)) {
+            stderr_output().error("%s",
+                    llvm::toString(std::move(err)).c_str());
+            return false;
+        }
+
+        std::vector<LibraryMember> linked;
+        for (unsigned task = 0; task < objects.size(); task++) {
+            if (objects[task].empty()) {
+                continue;
+            }
+            std::string name = task > 0 && task <= members.size()
+                    ? members[task - 1].name
+                    : "lto." + std::to_string(task) + ".o";
+            linked.push_back(LibraryMember{name, std::move(objects[task])});
+        }
+        members = std::move(linked);
+    }
+
+    // 5.
+    bool ok = write_library(members, path);
+    stderr_output().note("compiled %zu functions from %zu inputs to %s%s: "
+            "%zu errors, %zu top level expressions skipped", d.defs.size(),
+            used.size(), path, ThinLto ? " with thin lto" : "", errors,
+            d.skipped);
+    return ok && errors == 0;
+}
+
+
+int main(int argc, char** argv) {
+    // declared first so it runs last
+    StatsReport report;
+    std::vector<const char*> paths;
+    unsigned jobs = 0;
+    bool flat = false;
+    bool use_jit = false;
+    bool tiered = false;
+    const char* emit_path = nullptr;
+    const char* lib_path = nullptr;
+    const char* cache_dir = nullptr;
+    const char* ast_cache_dir = nullptr;
+    const char* batch_fn = nullptr;
+    const char* serve_path = nullptr;
+    const char* profile_generate_path = nullptr;
+    const char* profile_use_path = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bench") == 0
+                || strncmp(argv[i], "--bench=", 8) == 0) {
+            size_t mb = argv[i][7] == '=' ? atoi(argv[i] + 8) : 8;
+            return run_benchmarks((mb ? mb : 1) << 20);
+        } else if (strcmp(argv[i], "--flat") == 0) {
+            flat = true;
+        } else if (strcmp(argv[i], "--jit") == 0) {
+            use_jit = true;
+        } else if (strncmp(argv[i], "--emit=", 7) == 0) {
+            emit_path = argv[i] + 7;
+        } else if (strncmp(argv[i], "--emit-lib=", 11) == 0) {
+            lib_path = argv[i] + 11;
+        } else if (strcmp(argv[i], "--thin-lto") == 0) {
+            ThinLto = true;
+        } else if (strncmp(argv[i], "--profile-generate=", 19) == 0) {
+            profile_generate_path = argv[i] + 19;
+        } else if (strncmp(argv[i], "--profile-use=", 14) == 0) {
+            profile_use_path = argv[i] + 14;
+        } else if (strncmp(argv[i], "--cache=", 8) == 0) {
+            cache_dir = argv[i] + 8;
+        } else if (strncmp(argv[i], "--ast-cache=", 12) == 0) {
+            ast_cache_dir = argv[i] + 12;
+        } else if (strncmp(argv[i], "--serve=", 8) == 0) {
+            serve_path = argv[i] + 8;
+        } else if (strncmp(argv[i], "--batch=", 8) == 0) {
+            batch_fn = argv[i] + 8;
+        } else if (strcmp(argv[i], "--tiered") == 0
+                || strncmp(argv[i], "--tiered=", 9) == 0) {
+            // --tiered[=<calls before compiling>]
+            tiered = true;
+            if (argv[i][8] == '=') {
+                TierUpCalls = std::max(atoi(argv[i] + 9), 1);
+            }
+        } else if (argv[i][0] == '-' && argv[i][1] == 'O'
+                && argv[i][2] >= '0' && argv[i][2] <= '3'
+                && argv[i][3] == '\0') {
+            OptLevel = argv[i][2] - '0';
+        } else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+            jobs = std::max(atoi(argv[i] + 7), 1);
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            report.print = true;
+        } else if (strncmp(argv[i], "--stats-json=", 13) == 0) {
+            report.json_path = argv[i] + 13;
+        } else if (strncmp(argv[i], "--time-trace=", 13) == 0) {
+            report.trace_path = argv[i] + 13;
+        } else if (strncmp(argv[i], "--time-trace-granularity=", 25) == 0) {
+            TimeTraceGranularity = atoi(argv[i] + 25);
+        } else if (strncmp(argv[i], "--tokens=", 9) == 0) {
+            // how the parallel driver feeds its parsers
+            const char* feed = argv[i] + 9;
+            if (strcmp(feed, "pull") == 0) {
+                DriverTokenFeed = TokenFeed::Pull;
+            } else if (strcmp(feed, "array") == 0) {
+                DriverTokenFeed = TokenFeed::Array;
+            } else if (strcmp(feed, "queue") == 0) {
+                DriverTokenFeed = TokenFeed::Queue;
+            } else {
+                fprintf(stderr, "Error: unknown token feed %s\n", feed);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--fold") == 0
+                || strncmp(argv[i], "--fold=", 7) == 0) {
+            // --fold[=fast-math]
+            FoldConstants = true;
+            if (argv[i][6] == '=') {
+                if (strcmp(argv[i] + 7, "fast-math") != 0) {
+                    fprintf(stderr, "Error: unknown folding %s\n",
+                            argv[i] + 7);
+                    return 1;
+                }
+                FoldFastMath = true;
+            }
+        } else if (strcmp(argv[i], "--hash-cons") == 0) {
+            HashConsing = true;
+        } else if (strcmp(argv[i], "--quiet") == 0) {
+            QuietOutput = true;
+        } else if (strncmp(argv[i], "--diagnostics=", 14) == 0) {
+            const char* format = argv[i] + 14;
+            if (strcmp(format, "text") == 0) {
+                JsonDiagnostics = false;
+            } else if (strcmp(format, "json") == 0) {
+                JsonDiagnostics = true;
+            } else {
+                fprintf(stderr, "Error: unknown diagnostics format %s\n",
+                        format);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--explicit-stack") == 0) {
+            ExplicitStackParse = true;
+        } else if (strncmp(argv[i], "--binop=", 8) == 0) {
+            // --binop=<op>:<precedence>, e.g. --binop=<:50. only changes
+            // the precedence of the operators codegen implements, + - * /
+            // and <, anything else parses but fails to compile. the chars
+            // that delimit calls, items and numbers can't be operators.
+            // precedences start at 1, -1 is for chars that aren't
+            // operators.
+            const char* spec = argv[i] + 8;
+            unsigned char op = spec[0];
+            char* end = nullptr;
+            long prec = op && spec[1] == ':' ? strtol(spec + 2, &end, 10) : 0;
+            if (op == '\0' || spec[1] != ':' || isalnum(op) || isspace(op)
+                    || strchr("(),;.", op) || end == spec + 2 || *end != '\0'
+                    || prec < 1 || prec > INT_MAX) {
+                fprintf(stderr, "Error: bad operator spec %s\n", argv[i]);
+                return 1;
+            }
+            set_binop_precedence(spec[0], static_cast<int>(prec));
+        } else {
+            paths.push_back(argv[i]);
+        }
+    }
+
+#ifdef KALEIDOSCOPE_NO_STATS
+    if (report.print || report.json_path || report.trace_path) {
+        fprintf(stderr, "Error: built without stats, see "
+                "KALEIDOSCOPE_NO_STATS\n");
+        report = StatsReport();
+        return 1;
+    }
+#endif
+    StatsEnabled = report.print || report.json_path;
+    if (report.trace_path) {
+        TimeTraceEnabled = true;
+        llvm::timeTraceProfilerInitialize(TimeTraceGranularity, argv[0]);
+    }
+
+    // --batch=<fn> runs the repl over the file with fn's definition, then
+    // fn over the rows on stdin, see batch_eval_stdin(). --jobs is the
+    // threads it gets.
+    if (batch_fn) {
+        if (paths.size() != 1 || emit_path || tiered) {
+            fprintf(stderr, "Error: --batch needs the one file defining its "
+                    "function, and the jit without --tiered or --emit\n");
+            return 1;
+        }
+        use_jit = true;
+        ReplPrompt = false;
+    }
+    // --serve=<socket> runs the repl over the prelude, if there is one, and
+    // then serves sessions, see Server. --jobs is the threads they get.
+    if (serve_path) {
+        if (paths.size() > 1 || emit_path || tiered || batch_fn) {
+            fprintf(stderr, "Error: --serve takes at most one file, its "
+                    "prelude, and the jit without --tiered, --emit or "
+                    "--batch\n");
+            return 1;
+        }
+        use_jit = true;
+        ReplPrompt = false;
+    }
+    // --emit-lib=<file> builds a library with an object per input file,
+    // see compile_library()
+    if (lib_path && (emit_path || batch_fn || serve_path)) {
+        fprintf(stderr, "Error: --emit-lib goes with none of --emit, "
+                "--batch or --serve\n");
+        return 1;
+    }
+    if (ThinLto && !lib_path) {
+        fprintf(stderr, "Error: --thin-lto needs --emit-lib\n");
+        return 1;
+    }
+    bool driver = !batch_fn && !serve_path && (paths.size() > 1 || jobs);
+
+    // --profile-generate=<file> counts in code the jit runs, which is
+    // where the counters are, see Profile. --profile-use=<file> goes with
+    // anything that generates code.
+    if (profile_generate_path && (emit_path || lib_path || driver
+                                  || !(use_jit || tiered))) {
+        fprintf(stderr, "Error: --profile-generate needs the repl with "
+                "--jit, --tiered, --batch or --serve\n");
+        return 1;
+    }
+    // the counters' addresses are in the code, so its cache keys would
+    // change on every run and never hit
+    if (profile_generate_path && cache_dir) {
+        fprintf(stderr, "Error: --profile-generate goes without --cache\n");
+        return 1;
+    }
+    // declared before the jit, the code it runs counts into generated
+    Profile generated;
+    Profile used;
+    if (profile_use_path) {
+        if (!used.read(profile_use_path)) {
+            return 1;
+        }
+        ProfileUse = &used;
+    }
+    if (profile_generate_path) {
+        ProfileGenerate = &generated;
+    }
+    auto write_profile = [&] {
+        return !profile_generate_path
+                || generated.write(profile_generate_path);
+    };
+
+    // the repl runs each item as it is parsed, so only the parallel driver
+    // below has a whole file's AST to cache
+    std::unique_ptr<AstCacheDir> ast_cache;
+    if (ast_cache_dir && (emit_path || lib_path || driver)) {
+        ast_cache = std::make_unique<AstCacheDir>();
+        if (!ast_cache->open(ast_cache_dir)) {
+            return 1;
+        }
+    }
+    auto report_ast_cache = [&] {
+        if (ast_cache) {
+            stderr_output().note("ast cache: %u hits, %u stored",
+                    ast_cache->hits.load(), ast_cache->stored);
+        }
+    };
+
+    // --emit=<file> compiles all of the input into one file, see
+    // compile_unit()
+    if (emit_path) {
+        TranslationUnit unit;
+        bool ok = parse_files(paths, jobs ? jobs : default_jobs(), unit,
+                              ast_cache.get());
+        report_ast_cache();
+        ok = compile_unit(unit, jobs ? jobs : default_jobs(), emit_path)
+                && ok;
+        return ok && unit.errors == 0 ? 0 : 1;
+    }
+    if (lib_path) {
+        TranslationUnit unit;
+        bool ok = parse_files(paths, jobs ? jobs : default_jobs(), unit,
+                              ast_cache.get());
+        report_ast_cache();
+        ok = compile_library(unit, paths, jobs ? jobs : default_jobs(),
+                             lib_path) && ok;
+        return ok && unit.errors == 0 ? 0 : 1;
+    }
+
+    // several files, or asking for threads, parses them all up front
+    // instead of running the repl
+    if (driver) {
+        TranslationUnit unit;
+        bool ok = parse_files(paths, jobs ? jobs : default_jobs(), unit,
+                              ast_cache.get());
+        report_ast_cache();
+        stderr_output().note("parsed %zu files: %zu functions, %zu externs, "
+                "%zu symbols, %zu errors", paths.size(),
+                unit.functions.size(), unit.externs.size(),
+                unit.symbols.size(), unit.errors);
+        return ok && unit.errors == 0 ? 0 : 1;
+    }
+
+    const char* path = paths.empty() ? nullptr : paths[0];
+    std::unique_ptr<InputSource> src;
+    if (path) {
+        auto file = std::make_unique<MappedFileSource>();
+        if (!file->open(path)) {
+            report_open_error(*file, path);
+            return 1;
+        }
+        src = std::move(file);
+    } else if (serve_path) {
+        src = std::make_unique<MemorySource>(std::string());
+    } else {
+        src = std::make_unique<BufferedStdinSource>();
+    }
+    SymbolTable symbols;
+    Lexer lex(*src, symbols);
+    TokenStream toks(lex);
+    AstContext ctx;
+    CodeGen cg(symbols, "repl");
+    Optimizer opt(OptLevel);
+
+    // without --jit the repl only prints the IR
+    std::unique_ptr<ObjectCacheDir> cache;
+    if (cache_dir && (use_jit || tiered)) {
+        cache = std::make_unique<ObjectCacheDir>();
+        if (!cache->open(cache_dir)) {
+            return 1;
+        }
+    }
+
+    std::unique_ptr<Jit> jit;
+    if (use_jit || tiered) {
+        jit = std::make_unique<Jit>();
+        if (!jit->init(opt, cache.get())) {
+            return 1;
+        }
+        cg.set_data_layout(jit->get_data_layout());
+    }
+
+    std::unique_ptr<Interpreter> interp;
+    if (tiered) {
+        interp = std::make_unique<Interpreter>(symbols, cg, *jit);
+    }
+    std::unique_ptr<BatchKernel> batch;
+    if (batch_fn) {
+        batch = std::make_unique<BatchKernel>(*jit, cg, batch_fn);
+    }
+    Repl repl{cg, opt, jit.get(), interp.get(), batch.get()};
+    if (path) {
+        repl.source = path;
+    }
+
+    /*
+    while (CurTok != tok_eof) {
+        print_curtok();
+        get_next_token();
+    }
+    */
+
+    if (flat) {
+        FlatExprPool pool;
+        with_builder<FlatBuilder>([&](auto tag) {
+            using B = typename decltype(tag)::type;
+            run_repl<B>(toks, pool, ctx, repl);
+        });
+    } else {
+        with_builder<TreeBuilder>([&](auto tag) {
+            using B = typename decltype(tag)::type;
+            run_repl<B>(toks, ctx, ctx, repl);
+        });
+    }
+
+    bool ok = true;
+    if (batch && !batch->ready()) {
+        stderr_output().error("no definition of %s to run", batch_fn);
+        ok = false;
+    } else if (batch) {
+        ok = batch_eval_stdin(*batch, jobs ? jobs : default_jobs());
+    }
+
+    if (serve_path) {
+        Server server(*jit, cg, symbols, opt, flat,
+                      jobs ? jobs : default_jobs());
+        ok = server.serve(serve_path);
+    }
+
+    if (cache) {
+        stderr_output().note("object cache: %u hits, %u stored", cache->hits,
+                cache->stored);
+    }
+    ok = write_profile() && ok;
+    return ok ? 0 : 1;
 }